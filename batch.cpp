@@ -0,0 +1,346 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QImageReader>
+#include <QTextStream>
+#include <QFileInfo>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QFile>
+#include <QDir>
+#include <cstring>
+
+#include "graph.h"
+#include "parallel.h"
+#include "tiledcut.h"
+#include "trace.h"
+
+using namespace std;
+
+namespace {
+
+struct Job {
+  QString image;
+  QString seeds;
+  QString output;
+};
+
+struct Options {
+  Graph::Engine engine;
+  Graph::Connectivity connectivity;
+  Graph::Precision precision = Graph::Precision::Single;
+  Graph::Capacity capacity = Graph::Capacity::Float;
+  int tile = 0; // 0 - the whole image at once
+  int threads = 1; // per image, tiles are cut in parallel
+};
+
+QMutex log_mutex;
+
+void report(const QString& message) {
+  QMutexLocker lock(&log_mutex);
+  QTextStream(stderr) << message << endl;
+}
+
+// Seeds drawn over the image: red pixels are the source (object),
+// blue pixels are the sink (background), the same colours as in Viewport.
+// Formats that can read a part of an image are read in strips.
+bool readSeedBitmap(const QString& filename, const QSize& size, QVector<QPoint>& source, QVector<QPoint>& sink) {
+  if (QImageReader(filename).size() != size) return false;
+
+  const int strip = QImageReader(filename).supportsOption(QImageIOHandler::ClipRect) ? 256 : size.height();
+  for (int top = 0; top < size.height(); top += strip) {
+    QImageReader reader(filename);
+    if (strip < size.height()) reader.setClipRect(QRect(0, top, size.width(), qMin(strip, size.height() - top)));
+
+    QImage seeds = reader.read().convertToFormat(QImage::Format_RGB888);
+    if (seeds.isNull()) return false;
+
+    for (int y = 0; y < seeds.height(); ++y) {
+      const uchar* line = seeds.constScanLine(y);
+      for (int x = 0; x < seeds.width(); ++x) {
+        int r = line[3*x], g = line[3*x + 1], b = line[3*x + 2];
+        if (r >= 128 && g < 128 && b < 128) source << QPoint(x, top + y);
+        else if (b >= 128 && r < 128 && g < 128) sink << QPoint(x, top + y);
+      }
+    }
+  }
+
+  return true;
+}
+
+// Seeds as a pixel list, one per line: "fg <x> <y>" or "bg <x> <y>".
+// Empty lines and lines starting with '#' are skipped.
+bool readSeedList(const QString& filename, const QSize& size, QVector<QPoint>& source, QVector<QPoint>& sink) {
+  QFile file(filename);
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) return false;
+
+  QTextStream stream(&file);
+  while (!stream.atEnd()) {
+    auto line = stream.readLine().trimmed();
+    if (line.isEmpty() || line.startsWith('#')) continue;
+
+    auto fields = line.split(' ', QString::SkipEmptyParts);
+    if (fields.size() != 3) return false;
+
+    bool ok_x = false, ok_y = false;
+    int x = fields[1].toInt(&ok_x), y = fields[2].toInt(&ok_y);
+    if (!ok_x || !ok_y || x < 0 || y < 0 || x >= size.width() || y >= size.height()) return false;
+
+    if (fields[0] == "fg") source << QPoint(x, y);
+    else if (fields[0] == "bg") sink << QPoint(x, y);
+    else return false;
+  }
+
+  return true;
+}
+
+bool readSeeds(const QString& filename, const QSize& size, QVector<QPoint>& source, QVector<QPoint>& sink) {
+  if (QFileInfo(filename).suffix().toLower() == "txt") {
+    return readSeedList(filename, size, source, sink);
+  }
+  return readSeedBitmap(filename, size, source, sink);
+}
+
+QVector<int> indices(const QVector<QPoint>& points, int width) {
+  QVector<int> result;
+  for (auto& point : points) {
+    result << point.x() + point.y()*width;
+  }
+
+  return result;
+}
+
+// graph of the image with the capacity type of the options
+template <class G>
+Matrix<bool> cutImage(const QImage& image, const QVector<QPoint>& source, const QVector<QPoint>& sink, const Options& options) {
+  G graph = G::fromImage(image, Matrix<uint8_t>(), options.connectivity, 1, options.precision);
+  auto cut = graph.minCut(indices(source, image.width()), indices(sink, image.width()), options.engine);
+
+  Matrix<bool> foreground(image.size(), false);
+  graph.fillMask(cut, foreground);
+  return foreground;
+}
+
+// the mask is written as a binary PGM, tile by tile
+bool segmentTiled(const Job& job, const Options& options) {
+  QSize size = QImageReader(job.image).size();
+  if (!size.isValid()) {
+    report("can't read image " + job.image);
+    return false;
+  }
+
+  QVector<QPoint> source, sink;
+  if (!readSeeds(job.seeds, size, source, sink)) {
+    report("can't read seeds " + job.seeds);
+    return false;
+  }
+  if (source.isEmpty() || sink.isEmpty()) {
+    report("no object or background seeds in " + job.seeds);
+    return false;
+  }
+
+  TiledCut cut(options.tile);
+  cut.setThreads(options.threads);
+  cut.setEngine(options.engine);
+  cut.setConnectivity(options.connectivity);
+  if (!cut.segment(job.image, source, sink, job.output)) {
+    report(cut.errorString());
+    return false;
+  }
+
+  return true;
+}
+
+// fromImage -> minCut -> fillMask, the same pipeline as MainWindow::slotRun
+bool segment(const Job& job, const Options& options) {
+  if (options.tile > 0) {
+    return segmentTiled(job, options);
+  }
+
+  // a larger grid can't be numbered, such images are cut in tiles
+  QSize size = QImageReader(job.image).size();
+  qint64 limit = options.capacity == Graph::Capacity::Int32 ? BasicGraph<qint32>::maxPixels(options.connectivity) :
+                 options.capacity == Graph::Capacity::Int16 ? BasicGraph<qint16>::maxPixels(options.connectivity) :
+                                                              Graph::maxPixels(options.connectivity);
+  if (size.isValid() && qint64(size.width())*size.height() > limit) {
+    report(QString("%1 has more than %2 pixels, cut it in tiles with -t").arg(job.image).arg(limit));
+    return false;
+  }
+
+  QImage image(job.image);
+  if (image.isNull()) {
+    report("can't read image " + job.image);
+    return false;
+  }
+  image = image.convertToFormat(QImage::Format_RGB888);
+
+  QVector<QPoint> source, sink;
+  if (!readSeeds(job.seeds, image.size(), source, sink)) {
+    report("can't read seeds " + job.seeds);
+    return false;
+  }
+  if (source.isEmpty() || sink.isEmpty()) {
+    report("no object or background seeds in " + job.seeds);
+    return false;
+  }
+
+  // images are processed in parallel already
+  Matrix<bool> foreground;
+  switch (options.capacity) {
+  case Graph::Capacity::Float:
+    foreground = cutImage<Graph>(image, source, sink, options);
+    break;
+  case Graph::Capacity::Int32:
+    foreground = cutImage<BasicGraph<qint32>>(image, source, sink, options);
+    break;
+  case Graph::Capacity::Int16:
+    foreground = cutImage<BasicGraph<qint16>>(image, source, sink, options);
+    break;
+  }
+  auto bytes = foreground.to<uint8_t>();
+
+  QImage mask(image.size(), QImage::Format_Indexed8);
+  mask.setColorTable({qRgb(0, 0, 0), qRgb(255, 255, 255)});
+  for (int y = 0; y < image.height(); ++y) {
+    memcpy(mask.scanLine(y), bytes.line(y), image.width());
+  }
+
+  if (!mask.save(job.output)) {
+    report("can't write mask " + job.output);
+    return false;
+  }
+
+  return true;
+}
+
+// Pairs every image of a directory with the seeds of the same base name,
+// a bitmap of any readable format or a .txt pixel list.
+QVector<Job> collectJobs(const QString& images, const QString& seeds, const QString& output, const QString& suffix) {
+  QStringList filters;
+  for (auto& format : QImageReader::supportedImageFormats()) {
+    filters << "*." + QString::fromLatin1(format);
+  }
+
+  QVector<Job> jobs;
+  QDir image_dir(images), seed_dir(seeds), output_dir(output);
+  for (auto& info : image_dir.entryInfoList(filters, QDir::Files, QDir::Name)) {
+    auto candidates = seed_dir.entryInfoList(QStringList(info.completeBaseName() + ".*"), QDir::Files, QDir::Name);
+    if (candidates.isEmpty()) {
+      report("no seeds for " + info.filePath() + ", skipped");
+      continue;
+    }
+
+    jobs << Job{info.filePath(), candidates.first().filePath(), output_dir.filePath(info.completeBaseName() + suffix)};
+  }
+
+  return jobs;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("graph-cut-batch");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Segments images by seeds without the user interface. Seeds are a bitmap "
+                                   "(red - object, blue - background) or a text file of \"fg|bg <x> <y>\" lines. "
+                                   "Given directories, every image is matched with the seeds of the same name.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("image", "Image file or directory of images.");
+  parser.addPositionalArgument("seeds", "Seed file or directory of seed files.");
+  parser.addPositionalArgument("output", "Mask file or directory for the masks.");
+
+  QCommandLineOption threads_option({"j", "jobs"}, "Number of images processed at once.", "count",
+                                    QString::number(QThread::idealThreadCount()));
+  QCommandLineOption engine_option({"e", "engine"}, "Max-flow engine: ek, bk or pr.", "engine", "bk");
+  QCommandLineOption connectivity_option({"c", "connectivity"}, "Pixel neighbourhood: 4 or 8.", "n", "4");
+  QCommandLineOption tile_option({"t", "tile"}, "Cut images too large for memory in tiles of this size, "
+                                 "the masks are written as binary PGM. Not with --compact or integer --capacity.", "pixels", "0");
+  QCommandLineOption capacity_option("capacity", "Residual capacities: float, int32 or int16. Integer "
+                                     "cuts are exact and the same on every machine.", "type", "float");
+  QCommandLineOption compact_option("compact", "Keep the n-link weights in 16 bits, the graph takes about "
+                                    "a third less memory.");
+  QCommandLineOption trace_option("trace", "Record the stages of every image into a Chrome trace (.json) "
+                                  "or a CSV summary (.csv).", "file");
+  parser.addOption(threads_option);
+  parser.addOption(engine_option);
+  parser.addOption(connectivity_option);
+  parser.addOption(tile_option);
+  parser.addOption(capacity_option);
+  parser.addOption(compact_option);
+  parser.addOption(trace_option);
+  parser.process(app);
+
+  auto args = parser.positionalArguments();
+  if (args.size() != 3) {
+    parser.showHelp(1);
+  }
+
+  Options options;
+  auto engine = parser.value(engine_option);
+  if (engine == "ek") options.engine = Graph::Engine::EdmondsKarp;
+  else if (engine == "bk") options.engine = Graph::Engine::BoykovKolmogorov;
+  else if (engine == "pr") options.engine = Graph::Engine::PushRelabel;
+  else {
+    report("unknown engine " + engine);
+    return 1;
+  }
+
+  auto connectivity = parser.value(connectivity_option);
+  if (connectivity == "4") options.connectivity = Graph::Connectivity::Four;
+  else if (connectivity == "8") options.connectivity = Graph::Connectivity::Eight;
+  else {
+    report("connectivity must be 4 or 8");
+    return 1;
+  }
+
+  auto capacity = parser.value(capacity_option);
+  if (capacity == "float") options.capacity = Graph::Capacity::Float;
+  else if (capacity == "int32") options.capacity = Graph::Capacity::Int32;
+  else if (capacity == "int16") options.capacity = Graph::Capacity::Int16;
+  else {
+    report("unknown capacity type " + capacity);
+    return 1;
+  }
+
+  if (parser.isSet(compact_option)) options.precision = Graph::Precision::Compact;
+  options.tile = qMax(0, parser.value(tile_option).toInt());
+
+  // the bands of the tiles are float graphs of Pyramid
+  if (options.tile > 0 && (options.precision != Graph::Precision::Single || options.capacity != Graph::Capacity::Float)) {
+    report("--compact and integer --capacity can't be used with -t, tiles are cut with float weights");
+    return 1;
+  }
+
+  int threads = qMax(1, parser.value(threads_option).toInt());
+
+  QVector<Job> jobs;
+  if (QFileInfo(args[0]).isDir()) {
+    if (!QDir().mkpath(args[2])) {
+      report("can't create " + args[2]);
+      return 1;
+    }
+    jobs = collectJobs(args[0], args[1], args[2], options.tile > 0 ? ".pgm" : ".png");
+  }
+  else {
+    jobs << Job{args[0], args[1], args[2]};
+  }
+
+  // a large image takes all of the threads for its tiles, one at a time
+  if (options.tile > 0) {
+    options.threads = threads;
+    threads = 1;
+  }
+
+  Trace::setEnabled(parser.isSet(trace_option));
+  QAtomicInt failed(0);
+  parallelFor(jobs.size(), threads, [&](int i) {
+    if (!segment(jobs[i], options)) failed.ref();
+  });
+
+  report(QString("%1 of %2 images segmented").arg(jobs.size() - failed.load()).arg(jobs.size()));
+  if (parser.isSet(trace_option) && !Trace::save(parser.value(trace_option))) {
+    report("can't write " + parser.value(trace_option));
+  }
+  return failed.load() ? 2 : 0;
+}
@@ -0,0 +1,509 @@
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QTextStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QFileInfo>
+#include <QtMath>
+#include <QFile>
+#include <algorithm>
+#include <random>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "mainwindow.h"
+#include "graph.h"
+#include "pyramid.h"
+#include "superpixels.h"
+#include "trace.h"
+
+using namespace std;
+
+namespace {
+
+// peak resident set size of the process in kilobytes
+qint64 peakRss() {
+#ifdef Q_OS_WIN
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1;
+  return counters.PeakWorkingSetSize / 1024;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) return -1;
+#ifdef Q_OS_MAC
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// A bright disc on a noisy dark background, the same for a given size on every run.
+QImage syntheticImage(const QSize& size) {
+  QImage image(size, QImage::Format_RGB888);
+  mt19937 rng(size.width()*31 + size.height());
+  uniform_int_distribution<int> noise(0, 40);
+
+  int cx = size.width() / 2, cy = size.height() / 2;
+  qint64 radius = qMin(size.width(), size.height()) / 3;
+  for (int y = 0; y < size.height(); ++y) {
+    uchar* line = image.scanLine(y);
+    for (int x = 0; x < size.width(); ++x) {
+      bool inside = qint64(x - cx)*(x - cx) + qint64(y - cy)*(y - cy) < radius*radius;
+      int base = inside ? 180 : 40;
+      line[3*x] = base + noise(rng);
+      line[3*x + 1] = base + noise(rng);
+      line[3*x + 2] = (inside ? 60 : 40) + noise(rng);
+    }
+  }
+
+  return image;
+}
+
+// Fixed seed pattern: a cross in the middle third of the image for the
+// object and the one pixel frame of the image for the background.
+void seeds(const QSize& size, QVector<int>& source, QVector<int>& sink) {
+  int w = size.width(), h = size.height();
+  for (int x = w / 3; x < 2*w / 3; ++x) source << x + (h / 2)*w;
+  for (int y = h / 3; y < 2*h / 3; ++y) source << w / 2 + y*w;
+
+  for (int x = 0; x < w; ++x) sink << x << x + (h - 1)*w;
+  for (int y = 1; y < h - 1; ++y) sink << y*w << w - 1 + y*w;
+}
+
+double median(QVector<double> values) {
+  sort(values.begin(), values.end());
+  int n = values.size();
+  return n % 2 ? values[n / 2] : 0.5*(values[n / 2 - 1] + values[n / 2]);
+}
+
+struct Case {
+  QString name;
+  QImage image;
+};
+
+// accuracy gap of 'labels' against the full resolution cut
+struct Gap {
+  int mismatch = 0;
+  int intersection = 0, united = 0;
+
+  Gap() = default;
+  Gap(const Matrix<bool>& mask, const Matrix<uint8_t>& labels) {
+    for (int y = 0; y < labels.height(); ++y) {
+      for (int x = 0; x < labels.width(); ++x) {
+        bool full = mask(x, y), rough = labels(x, y) == Pyramid::Foreground;
+        mismatch += full != rough;
+        intersection += full && rough;
+        united += full || rough;
+      }
+    }
+  }
+
+  double iou() const {
+    return united ? double(intersection) / united : 1.0;
+  }
+};
+
+// milliseconds of the graph stages of one run
+struct GraphRun {
+  double build = 0, cut = 0, fg = 0, bg = 0, fill = 0;
+  int augmentations = 0, nodes = 0, arcs = 0;
+};
+
+template <class G>
+GraphRun runGraph(const QImage& image, const QVector<int>& source, const QVector<int>& sink,
+                  Graph::Connectivity connectivity, Graph::Precision precision, Graph::Engine engine, int threads,
+                  Matrix<bool>& mask) {
+  GraphRun run;
+  QElapsedTimer timer;
+
+  timer.start();
+  auto graph = G::fromImage(image, Matrix<uint8_t>(), connectivity, threads, precision);
+  run.build = timer.nsecsElapsed() / 1e6;
+
+  timer.start();
+  auto cut = graph.minCut(source, sink, engine);
+  run.cut = timer.nsecsElapsed() / 1e6;
+
+  timer.start();
+  graph.getForeground(cut);
+  run.fg = timer.nsecsElapsed() / 1e6;
+
+  timer.start();
+  graph.getBackground(cut);
+  run.bg = timer.nsecsElapsed() / 1e6;
+
+  timer.start();
+  graph.fillMask(cut, mask);
+  run.fill = timer.nsecsElapsed() / 1e6;
+
+  run.augmentations = graph.augmentations();
+  run.nodes = graph.nodeCount();
+  run.arcs = graph.arcCount();
+  return run;
+}
+
+// Pixels where a BK cut reusing the flow of the steps before differs from a fresh
+// one, summed over 'steps' random changes of the mask and the seeds. The seeds are
+// scattered pixels, so that the search trees change a lot from step to step.
+template <class G>
+int warmMismatch(const QImage& image, Graph::Connectivity connectivity, Graph::Precision precision,
+                 int threads, int steps) {
+  mt19937 rng(steps);
+  int w = image.width(), h = image.height();
+  QVector<int> sources, sinks;
+  auto warm = G::fromImage(image, Matrix<uint8_t>(), connectivity, threads, precision);
+
+  int mismatch = 0;
+  for (int step = 0; step < steps; ++step) {
+    // most of the time a disc is masked out, seeds are added and dropped at random
+    Matrix<bool> mask(image.size(), true);
+    if (rng() % 3) {
+      int cx = rng() % w, cy = rng() % h;
+      qint64 radius = rng() % (qMin(w, h) / 2 + 1);
+      for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+          if (qint64(x - cx)*(x - cx) + qint64(y - cy)*(y - cy) < radius*radius) mask(x, y) = false;
+        }
+      }
+    }
+    sources << int(rng() % (qint64(w)*h));
+    sinks << int(rng() % (qint64(w)*h));
+    for (int k = rng() % 8; k > 0; --k) {
+      (rng() % 2 ? sources : sinks) << int(rng() % (qint64(w)*h));
+    }
+    for (int k = rng() % 8; k > 0; --k) {
+      QVector<int>& list = rng() % 2 ? sources : sinks;
+      if (list.size() > 1) list.remove(rng() % list.size());
+    }
+
+    warm.setMask(mask);
+    auto cut = warm.minCut(sources, sinks, Graph::Engine::BoykovKolmogorov);
+    Matrix<bool> warm_mask(image.size(), false);
+    warm.fillMask(cut, warm_mask);
+
+    auto fresh = G::fromImage(image, Matrix<uint8_t>(), connectivity, threads, precision);
+    fresh.setMask(mask);
+    cut = fresh.minCut(sources, sinks, Graph::Engine::BoykovKolmogorov);
+    Matrix<bool> fresh_mask(image.size(), false);
+    fresh.fillMask(cut, fresh_mask);
+
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        mismatch += warm_mask(x, y) != fresh_mask(x, y);
+      }
+    }
+  }
+
+  return mismatch;
+}
+
+QJsonObject run(const Case& test, Graph::Connectivity connectivity, Graph::Precision precision, Graph::Capacity capacity,
+                Graph::Engine engine, int repeats, int threads, int band, int superpixel, int superpixel_band,
+                int warm_steps, MainWindow& window) {
+  QVector<int> source, sink;
+  seeds(test.image.size(), source, sink);
+
+  QVector<double> build_ms, cut_ms, fg_ms, bg_ms, fill_ms, render_ms, pyramid_ms, slic_ms, region_cut_ms;
+  Gap pyramid_gap, superpixel_gap;
+  int augmentations = 0, nodes = 0, arcs = 0;
+  for (int r = 0; r < repeats; ++r) {
+    QElapsedTimer timer;
+
+    window.image = test.image;
+    window.mask = Matrix<bool>(test.image.size(), false);
+    GraphRun stages;
+    switch (capacity) {
+    case Graph::Capacity::Float:
+      stages = runGraph<Graph>(test.image, source, sink, connectivity, precision, engine, threads, window.mask);
+      break;
+    case Graph::Capacity::Int32:
+      stages = runGraph<BasicGraph<qint32>>(test.image, source, sink, connectivity, precision, engine, threads, window.mask);
+      break;
+    case Graph::Capacity::Int16:
+      stages = runGraph<BasicGraph<qint16>>(test.image, source, sink, connectivity, precision, engine, threads, window.mask);
+      break;
+    }
+    build_ms << stages.build;
+    cut_ms << stages.cut;
+    fg_ms << stages.fg;
+    bg_ms << stages.bg;
+    fill_ms << stages.fill;
+
+    timer.start();
+    window.applyMask();
+    render_ms << timer.nsecsElapsed() / 1e6;
+
+    if (band > 0) {
+      Pyramid pyramid(band);
+      pyramid.setEngine(engine);
+      pyramid.setConnectivity(connectivity);
+
+      timer.start();
+      auto labels = pyramid.segment(test.image, Matrix<uint8_t>(), source, sink);
+      pyramid_ms << timer.nsecsElapsed() / 1e6;
+      pyramid_gap = Gap(window.mask, labels);
+    }
+
+    if (superpixel > 0) {
+      timer.start();
+      Superpixels superpixels(test.image, superpixel, 10.0f, 5, threads);
+      slic_ms << timer.nsecsElapsed() / 1e6;
+
+      timer.start();
+      auto labels = superpixels.segment(test.image, Matrix<uint8_t>(), source, sink, engine, superpixel_band);
+      region_cut_ms << timer.nsecsElapsed() / 1e6;
+      superpixel_gap = Gap(window.mask, labels);
+    }
+
+    augmentations = stages.augmentations;
+    nodes = stages.nodes;
+    arcs = stages.arcs;
+  }
+
+  static const char* engines[] = {"ek", "bk", "pr"};
+  static const char* capacities[] = {"float", "int32", "int16"};
+  double build = median(build_ms), cut = median(cut_ms);
+
+  QJsonObject result;
+  result["image"] = test.name;
+  result["width"] = test.image.width();
+  result["height"] = test.image.height();
+  result["megapixels"] = test.image.width()*double(test.image.height()) / 1e6;
+  result["connectivity"] = int(connectivity);
+  result["precision"] = precision == Graph::Precision::Compact ? "compact" : "single";
+  result["capacity"] = capacities[int(capacity)];
+  result["engine"] = engines[int(engine)];
+  result["repeats"] = repeats;
+  result["from_image_ms"] = build;
+  result["min_cut_ms"] = cut;
+  result["get_foreground_ms"] = median(fg_ms);
+  result["get_background_ms"] = median(bg_ms);
+  result["fill_mask_ms"] = median(fill_ms);
+  result["apply_mask_ms"] = median(render_ms);
+  result["augmentations"] = augmentations;
+  result["nodes"] = nodes;
+  result["arcs"] = arcs;
+  result["build_arcs_per_s"] = build > 0 ? arcs / build * 1e3 : 0;
+  result["cut_nodes_per_s"] = cut > 0 ? nodes / cut * 1e3 : 0;
+  result["cut_arcs_per_s"] = cut > 0 ? arcs / cut * 1e3 : 0;
+  if (band > 0) {
+    result["pyramid_band"] = band;
+    result["pyramid_ms"] = median(pyramid_ms);
+    result["pyramid_mismatch"] = pyramid_gap.mismatch;
+    result["pyramid_iou"] = pyramid_gap.iou();
+  }
+  if (superpixel > 0) {
+    result["superpixel_size"] = superpixel;
+    result["superpixel_band"] = superpixel_band;
+    result["superpixels_ms"] = median(slic_ms);
+    result["superpixel_cut_ms"] = median(region_cut_ms);
+    result["superpixel_mismatch"] = superpixel_gap.mismatch;
+    result["superpixel_iou"] = superpixel_gap.iou();
+  }
+  if (warm_steps > 0 && engine == Graph::Engine::BoykovKolmogorov) {
+    int mismatch = 0;
+    switch (capacity) {
+    case Graph::Capacity::Float:
+      mismatch = warmMismatch<Graph>(test.image, connectivity, precision, threads, warm_steps);
+      break;
+    case Graph::Capacity::Int32:
+      mismatch = warmMismatch<BasicGraph<qint32>>(test.image, connectivity, precision, threads, warm_steps);
+      break;
+    case Graph::Capacity::Int16:
+      mismatch = warmMismatch<BasicGraph<qint16>>(test.image, connectivity, precision, threads, warm_steps);
+      break;
+    }
+    result["warm_steps"] = warm_steps;
+    result["warm_mismatch"] = mismatch;
+  }
+  result["peak_rss_kb"] = peakRss();
+  return result;
+}
+
+bool verbose = false;
+
+void messageHandler(QtMsgType type, const QMessageLogContext&, const QString& message) {
+  if (type == QtDebugMsg && !verbose) return;
+  QTextStream(stderr) << message << endl;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  // applyMask lives in MainWindow, which needs a GUI application but no display
+  if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  QApplication app(argc, argv);
+  QApplication::setApplicationName("graph-cut-bench");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Times Graph::fromImage, minCut, getForeground, getBackground, fillMask and "
+                                   "MainWindow::applyMask on synthetic images and the given images.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("images", "Real images to run besides the synthetic ones.", "[images...]");
+
+  QCommandLineOption sizes_option("sizes", "Synthetic image sizes in megapixels.", "list", "0.25,1,4,16,50");
+  QCommandLineOption engines_option("engines", "Engines to run: ek, bk, pr.", "list", "bk,pr");
+  QCommandLineOption connectivity_option("connectivity", "Connectivities to run: 4, 8.", "list", "4,8");
+  QCommandLineOption precision_option("precision", "N-link weights to run: single, compact.", "list", "single");
+  QCommandLineOption capacity_option("capacity", "Residual capacities to run: float, int32, int16.", "list", "float");
+  QCommandLineOption repeats_option("repeats", "Runs of every case, medians are reported.", "n", "3");
+  QCommandLineOption output_option({"o", "output"}, "JSON report file, stdout by default.", "file");
+  QCommandLineOption threads_option("threads", "Threads used to build the graph and by push-relabel.", "n",
+                                    QString::number(QThread::idealThreadCount()));
+  QCommandLineOption band_option("pyramid-band", "Also run the coarse-to-fine mode with this band width.", "pixels", "0");
+  QCommandLineOption superpixel_option("superpixel-size", "Also run the superpixel mode with regions of this size.", "pixels", "0");
+  QCommandLineOption superpixel_band_option("superpixel-band", "Band refined after the superpixel cut, 0 for none.", "pixels", "4");
+  QCommandLineOption warm_option("warm-steps", "Also compare BK runs reusing the flow with fresh ones over this many "
+                                 "random changes of the mask and the seeds, fails if they differ.", "n", "0");
+  QCommandLineOption verbose_option("verbose", "Keep debug output of the graph.");
+  QCommandLineOption trace_option("trace", "Record the stages of all runs into a Chrome trace (.json) "
+                                  "or a CSV summary (.csv).", "file");
+  parser.addOptions({sizes_option, engines_option, connectivity_option, precision_option, capacity_option,
+                     repeats_option, threads_option, band_option, superpixel_option, superpixel_band_option,
+                     warm_option, output_option, verbose_option, trace_option});
+  parser.process(app);
+
+  verbose = parser.isSet(verbose_option);
+  qInstallMessageHandler(messageHandler);
+
+  QVector<Case> cases;
+  for (auto& size : parser.value(sizes_option).split(',', QString::SkipEmptyParts)) {
+    double megapixels = size.toDouble();
+    if (megapixels <= 0) {
+      qWarning() << "bad size" << size;
+      return 1;
+    }
+
+    // 4:3 images
+    int width = qRound(qSqrt(megapixels*1e6*4/3)), height = qRound(width*0.75);
+    cases << Case{QString("synthetic-%1mp").arg(size), syntheticImage(QSize(width, height))};
+  }
+  for (auto& filename : parser.positionalArguments()) {
+    QImage image(filename);
+    if (image.isNull()) {
+      qWarning() << "can't read" << filename;
+      return 1;
+    }
+    cases << Case{QFileInfo(filename).fileName(), image.convertToFormat(QImage::Format_RGB888)};
+  }
+
+  // peak RSS only grows, so smaller cases go first
+  stable_sort(cases.begin(), cases.end(), [](const Case& lhs, const Case& rhs) {
+    return qint64(lhs.image.width())*lhs.image.height() < qint64(rhs.image.width())*rhs.image.height();
+  });
+
+  QVector<Graph::Engine> engines;
+  for (auto& engine : parser.value(engines_option).split(',', QString::SkipEmptyParts)) {
+    if (engine == "ek") engines << Graph::Engine::EdmondsKarp;
+    else if (engine == "bk") engines << Graph::Engine::BoykovKolmogorov;
+    else if (engine == "pr") engines << Graph::Engine::PushRelabel;
+    else {
+      qWarning() << "unknown engine" << engine;
+      return 1;
+    }
+  }
+
+  QVector<Graph::Connectivity> connectivities;
+  for (auto& connectivity : parser.value(connectivity_option).split(',', QString::SkipEmptyParts)) {
+    if (connectivity == "4") connectivities << Graph::Connectivity::Four;
+    else if (connectivity == "8") connectivities << Graph::Connectivity::Eight;
+    else {
+      qWarning() << "connectivity must be 4 or 8";
+      return 1;
+    }
+  }
+
+  QVector<Graph::Precision> precisions;
+  for (auto& precision : parser.value(precision_option).split(',', QString::SkipEmptyParts)) {
+    if (precision == "single") precisions << Graph::Precision::Single;
+    else if (precision == "compact") precisions << Graph::Precision::Compact;
+    else {
+      qWarning() << "unknown precision" << precision;
+      return 1;
+    }
+  }
+
+  QVector<Graph::Capacity> capacities;
+  for (auto& capacity : parser.value(capacity_option).split(',', QString::SkipEmptyParts)) {
+    if (capacity == "float") capacities << Graph::Capacity::Float;
+    else if (capacity == "int32") capacities << Graph::Capacity::Int32;
+    else if (capacity == "int16") capacities << Graph::Capacity::Int16;
+    else {
+      qWarning() << "unknown capacity type" << capacity;
+      return 1;
+    }
+  }
+
+  int repeats = qMax(1, parser.value(repeats_option).toInt());
+  int threads = qMax(1, parser.value(threads_option).toInt());
+  int band = qMax(0, parser.value(band_option).toInt());
+  int superpixel = qMax(0, parser.value(superpixel_option).toInt());
+  int superpixel_band = qMax(0, parser.value(superpixel_band_option).toInt());
+  int warm_steps = qMax(0, parser.value(warm_option).toInt());
+
+  MainWindow window(QString());
+  Trace::setEnabled(parser.isSet(trace_option));
+  QJsonArray results;
+  QTextStream log(stderr);
+  bool warm_failed = false;
+  for (auto& test : cases) {
+    for (auto connectivity : connectivities) {
+      for (auto precision : precisions) {
+        for (auto capacity : capacities) {
+          for (auto engine : engines) {
+            auto result = run(test, connectivity, precision, capacity, engine, repeats, threads, band, superpixel,
+                              superpixel_band, warm_steps, window);
+            results << result;
+            if (result["warm_mismatch"].toInt() > 0) {
+              log << result["image"].toString() << ": warm BK runs differ from fresh ones in "
+                  << result["warm_mismatch"].toInt() << " pixels" << endl;
+              warm_failed = true;
+            }
+            log << result["image"].toString() << " c" << result["connectivity"].toInt() << " "
+                << result["precision"].toString() << " " << result["capacity"].toString() << " "
+                << result["engine"].toString() << ": build " << result["from_image_ms"].toDouble() << " ms, cut "
+                << result["min_cut_ms"].toDouble() << " ms, " << result["augmentations"].toInt() << " paths, rss "
+                << result["peak_rss_kb"].toDouble() / 1024 << " MB" << endl;
+          }
+        }
+      }
+    }
+  }
+
+  if (parser.isSet(trace_option) && !Trace::save(parser.value(trace_option))) {
+    qWarning() << "can't write" << parser.value(trace_option);
+    return 1;
+  }
+
+  QJsonObject report;
+  report["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+  report["qt"] = qVersion();
+  report["threads"] = threads;
+  report["results"] = results;
+
+  auto json = QJsonDocument(report).toJson();
+  if (parser.isSet(output_option)) {
+    QFile file(parser.value(output_option));
+    if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+      qWarning() << "can't write" << parser.value(output_option);
+      return 1;
+    }
+  }
+  else {
+    QTextStream(stdout) << json;
+  }
+
+  return warm_failed ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+#include "components.h"
+#include "parallel.h"
+#include "trace.h"
+#include <algorithm>
+
+namespace {
+
+// union-find over pixel indices, every set is rooted at its smallest index,
+// so a parent always comes before its child in the row-major order
+int root(int* parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+
+  return i;
+}
+
+void unite(int* parent, int a, int b) {
+  a = root(parent, a);
+  b = root(parent, b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+}
+
+Components::Components(const Matrix<bool>& mask, int threads):
+  threads_(qMax(1, threads)),
+  mask_(mask),
+  labels_(mask.size())
+{
+  Trace::Scope scope("components");
+  const int w = mask.width(), h = mask.height();
+  if (!w || !h) return;
+
+  // a strip only links its own pixels, the strips are joined afterwards
+  const auto values = mask.to<uint8_t>();
+  QVector<int> parents(w*h);
+  int* parent = parents.data();
+  const int strips = qMax(1, qMin(h, 4*threads_));
+  parallelFor(strips, threads_, [&](int strip) {
+    int y0 = strip*h / strips, y1 = (strip + 1)*h / strips;
+    for (int y = y0; y < y1; ++y) {
+      const uint8_t* line = values.line(y);
+      const uint8_t* above = y > y0 ? values.line(y - 1) : nullptr;
+      for (int x = 0, i = y*w; x < w; ++x, ++i) {
+        parent[i] = i;
+        if (x > 0 && line[x - 1] == line[x]) unite(parent, i - 1, i);
+        if (above && above[x] == line[x]) unite(parent, i - w, i);
+      }
+    }
+  });
+
+  for (int strip = 1; strip < strips; ++strip) {
+    int y = strip*h / strips;
+    const uint8_t* line = values.line(y);
+    const uint8_t* above = values.line(y - 1);
+    for (int x = 0; x < w; ++x) {
+      if (above[x] == line[x]) unite(parent, x + (y - 1)*w, x + y*w);
+    }
+  }
+
+  // the root of a pixel is already labelled when the pixel is reached
+  for (int y = 0; y < h; ++y) {
+    const uint8_t* line = values.line(y);
+    int* label = labels_.line(y);
+    for (int x = 0, i = y*w; x < w; ++x, ++i) {
+      int r = parent[i] = parent[parent[i]];
+      if (r == i) {
+        label[x] = add(line[x] != 0, x, y);
+      }
+      else {
+        label[x] = labels_(r % w, r / w);
+        grow(label[x], x, y);
+      }
+    }
+  }
+}
+
+int Components::add(bool foreground, int x, int y) {
+  components_ << Component{foreground, 1, QRect(x, y, 1, 1)};
+  return components_.size() - 1;
+}
+
+void Components::grow(int label, int x, int y) {
+  auto& component = components_[label];
+  ++component.area;
+  if (x < component.bounds.left()) component.bounds.setLeft(x);
+  if (x > component.bounds.right()) component.bounds.setRight(x);
+  component.bounds.setBottom(y);
+}
+
+void Components::update(const Matrix<bool>& mask) {
+  if (isNull() || mask.size() != mask_.size()) {
+    *this = Components(mask, threads_);
+    return;
+  }
+
+  Trace::Scope scope("components.update");
+  const int w = mask.width(), h = mask.height();
+  static const int dx[] = {0, -1, 1, 0, 0};
+  static const int dy[] = {0, 0, 0, -1, 1};
+
+  // a changed pixel can split its old region or join it with a neighbouring one
+  QVector<bool> affected(components_.size(), false);
+  QVector<int> freed;
+  QRect rect;
+  auto changed = mask ^ mask_;
+  for (int y = 0; y < h; ++y) {
+    const Matrix<bool>::word_t* words = changed.line(y);
+    for (int k = 0; k < changed.wordsPerLine(); ++k) {
+      for (Matrix<bool>::word_t bits = words[k]; bits; bits &= bits - 1) {
+        int x = k*64 + trailingZeros(bits);
+        for (int i = 0; i < 5; ++i) {
+          int nx = x + dx[i], ny = y + dy[i];
+          if (nx < 0 || nx >= w || ny < 0 || ny >= h) continue;
+          int label = labels_(nx, ny);
+          if (affected[label]) continue;
+          affected[label] = true;
+          freed << label;
+          rect |= components_[label].bounds;
+        }
+      }
+    }
+  }
+  mask_ = mask;
+  if (freed.isEmpty()) return;
+
+  // Pixels of the affected regions are linked again inside of their bounds.
+  // A region that is left alone can't touch them with the same value, it
+  // would have been the same region or next to a changed pixel.
+  std::sort(freed.begin(), freed.end());
+  for (auto label : freed) {
+    components_[label].area = 0;
+    components_[label].bounds = QRect();
+  }
+
+  const int rw = rect.width(), rh = rect.height();
+  QVector<int> parents(rw*rh, -1);
+  int* parent = parents.data();
+  for (int y = 0; y < rh; ++y) {
+    const int* label = labels_.line(rect.y() + y) + rect.x();
+    for (int x = 0, i = y*rw; x < rw; ++x, ++i) {
+      if (!affected[label[x]]) continue;
+      parent[i] = i;
+      bool value = mask(rect.x() + x, rect.y() + y);
+      if (x > 0 && parent[i - 1] >= 0 && mask(rect.x() + x - 1, rect.y() + y) == value) unite(parent, i - 1, i);
+      if (y > 0 && parent[i - rw] >= 0 && mask(rect.x() + x, rect.y() + y - 1) == value) unite(parent, i - rw, i);
+    }
+  }
+
+  int next = 0;
+  for (int y = 0; y < rh; ++y) {
+    int* label = labels_.line(rect.y() + y) + rect.x();
+    for (int x = 0, i = y*rw; x < rw; ++x, ++i) {
+      if (parent[i] < 0) continue;
+
+      int r = parent[i] = parent[parent[i]];
+      int px = rect.x() + x, py = rect.y() + y;
+      if (r == i) {
+        bool value = mask(px, py);
+        if (next < freed.size()) {
+          label[x] = freed[next++];
+          components_[label[x]] = Component{value, 1, QRect(px, py, 1, 1)};
+        }
+        else {
+          label[x] = add(value, px, py);
+        }
+      }
+      else {
+        label[x] = labels_(rect.x() + r % rw, rect.y() + r / rw);
+        grow(label[x], px, py);
+      }
+    }
+  }
+}
+
+bool Components::isNull() const {
+  return labels_.isNull();
+}
+
+int Components::count() const {
+  return components_.size();
+}
+
+int Components::label(int x, int y) const {
+  return labels_(x, y);
+}
+
+const Matrix<int>& Components::labels() const {
+  return labels_;
+}
+
+const Components::Component& Components::component(int label) const {
+  return components_[label];
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <QRect>
+#include <QThread>
+#include <QVector>
+
+#include "matrix.h"
+
+// Connected regions of equal value of a mask, 4-neighbours. Row strips are
+// labelled by union-find in parallel, joined along the strip borders and
+// numbered from 0 in the row-major order of their first pixels.
+class Components {
+public:
+  struct Component {
+    bool foreground;
+    int area;    // 0 for a label freed by update
+    QRect bounds;
+  };
+
+  Components() = default;
+  explicit Components(const Matrix<bool>& mask, int threads = QThread::idealThreadCount());
+
+  // Labels 'mask' again, only the regions holding or touching a pixel that
+  // changed since the last mask are visited, the others keep their labels.
+  // Labels of the visited regions are reused before new ones are added.
+  void update(const Matrix<bool>& mask);
+
+  bool isNull() const;
+
+  // number of labels, freed ones included
+  int count() const;
+
+  int label(int x, int y) const;
+  const Matrix<int>& labels() const;
+  const Component& component(int label) const;
+
+private:
+  int threads_ = 1;
+  Matrix<bool> mask_;
+  Matrix<int> labels_;
+  QVector<Component> components_;
+
+  int add(bool foreground, int x, int y);
+  void grow(int label, int x, int y);
+};
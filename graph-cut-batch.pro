@@ -0,0 +1,26 @@
+QT       += core gui
+QT       -= widgets
+
+TARGET = graph-cut-batch
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+        batch.cpp \
+        graph.cpp \
+        pushrelabel.cpp \
+        pyramid.cpp \
+        tiledcut.cpp \
+        trace.cpp
+
+HEADERS += \
+        graph.h \
+		matrix.h \
+		parallel.h \
+		pyramid.h \
+		simd.h \
+		tiledcut.h \
+		trace.h
+
+CONFIG += c++11
@@ -0,0 +1,37 @@
+QT       += core gui widgets
+
+TARGET = graph-cut-bench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+        bench.cpp \
+        mainwindow.cpp\
+        components.cpp \
+        graph.cpp \
+        pushrelabel.cpp \
+        pyramid.cpp \
+        superpixels.cpp \
+        trace.cpp \
+		viewport.cpp \
+		worker.cpp
+
+HEADERS += \
+        mainwindow.h\
+        components.h \
+        graph.h \
+		matrix.h \
+		parallel.h \
+		pyramid.h \
+		simd.h \
+		superpixels.h \
+		trace.h \
+		viewport.h \
+		worker.h
+
+FORMS += mainwindow.ui
+
+win32: LIBS += -lpsapi
+
+CONFIG += c++11
@@ -8,14 +8,27 @@ TEMPLATE = app
 SOURCES += \
         main.cpp\
         mainwindow.cpp\
+        components.cpp \
         graph.cpp \
-		viewport.cpp
+        pushrelabel.cpp \
+        pyramid.cpp \
+        superpixels.cpp \
+        trace.cpp \
+		viewport.cpp \
+		worker.cpp
 
 HEADERS += \
         mainwindow.h\
+        components.h \
         graph.h \
 		matrix.h \
-		viewport.h
+		parallel.h \
+		pyramid.h \
+		simd.h \
+		superpixels.h \
+		trace.h \
+		viewport.h \
+		worker.h
 
 FORMS += mainwindow.ui
 
@@ -1,173 +1,1284 @@
 #include "graph.h"
+#include "simd.h"
+#include "parallel.h"
+#include "trace.h"
+#include <algorithm>
+#include <numeric>
 #include <QDebug>
-#include <QQueue>
 #include <QStack>
 #include <QtMath>
 #include <QTime>
 
 using namespace std;
 
-Graph::Graph(int size, const QSize& image_size):
-  size_(size),
-  parent_(size),
+// neighbour offsets ordered by the resulting pixel index, so arcs of every grid
+// node are sorted by head and the reverse of slot k is slot (connectivity - 1 - k)
+static const int dx4[] = {0, -1, 1, 0};
+static const int dy4[] = {-1, 0, 0, 1};
+static const int dx8[] = {-1, 0, 1, -1, 1, -1, 0, 1};
+static const int dy8[] = {-1, -1, -1, 0, 0, 1, 1, 1};
+
+// colour distance scale of the n-link weights
+static const float sigma = 2.0f;
+
+// Compact grids keep a weight as 16 bits of its logarithm: code 'c' stands
+// for exp(16 - c/512), which covers all of the positive floats, the last code is 0.
+static const int zero_code = 65535;
+
+template <class Cap>
+static const Cap* decodeTable() {
+  static const QVector<Cap> table = [] {
+    QVector<Cap> codes(zero_code + 1);
+    for (int c = 0; c < zero_code; ++c) {
+      codes[c] = CapacityTraits<Cap>::capacity(float(exp(16 - c / 512.0)));
+    }
+    codes[zero_code] = 0;
+    return codes;
+  }();
+  return table.constData();
+}
+
+template <class Cap>
+BasicGraph<Cap>::BasicGraph(int size, const QSize& image_size):
+  image_size_(image_size),
+  roi_(QPoint(0, 0), image_size),
+  full_size_(image_size),
+  size_(size)
+{
+
+}
+
+template <class Cap>
+BasicGraph<Cap>::BasicGraph(const QSize& image_size, const Connectivity& connectivity, int threads, Precision precision):
+  threads_(qMax(1, threads)),
   image_size_(image_size),
-  edges_(size)
+  roi_(QPoint(0, 0), image_size),
+  full_size_(image_size),
+  size_(image_size.width()*image_size.height()),
+  connectivity_(static_cast<int>(connectivity)),
+  shift_(connectivity_ == 4 ? 2 : 3)
 {
+  const int* dx = connectivity_ == 4 ? dx4 : dx8;
+  const int* dy = connectivity_ == 4 ? dy4 : dy8;
+  const int w = image_size.width(), h = image_size.height(), k_count = connectivity_;
 
+  for (int k = 0; k < k_count; ++k) {
+    offset_[k] = dx[k] + dy[k]*w;
+  }
+  links_.resize(size_);
+  if (precision == Precision::Compact) {
+    codes_.assign(size_t(size_)*k_count / 2, zero_code);
+    decode_ = decodeTable<Cap>();
+  }
+  else weight_.assign(size_t(size_)*k_count, -1);
+
+  // every band of rows fills the links of its own pixels only
+  quint16* links = links_.data();
+  parallelFor(rowBands(h), threads_, [=](int band) {
+    int y0 = band*h / rowBands(h), y1 = (band + 1)*h / rowBands(h);
+    for (int y = y0; y < y1; ++y) {
+      for (int x = 0; x < w; ++x) {
+        quint16 bits = 0;
+        for (int k = 0; k < k_count; ++k) {
+          int nx = x + dx[k], ny = y + dy[k];
+          if (nx >= 0 && nx < w && ny >= 0 && ny < h) bits |= 1 << k;
+        }
+        links[x + y*w] = bits;
+      }
+    }
+  });
 }
 
-Graph Graph::fromImage(const QImage& image, const Matrix<uint8_t>& mask, const Connectivity& connectivity) {
+float GraphBase::nlinkWeight(const uchar* p, const uchar* q, float length) {
+  int r = p[0] - q[0], g = p[1] - q[1], b = p[2] - q[2];
+  float distance = float(r*r + g*g + b*b), weight;
+  simd::nlinkWeights(&distance, &weight, 1, sigma, length);
+  return weight;
+}
+
+QRect GraphBase::regionOf(const Matrix<uint8_t>& mask) {
+  int left = mask.width(), right = -1, top = -1, bottom = -1;
+  for (int y = 0; y < mask.height(); ++y) {
+    const uint8_t* line = mask.line(y);
+    int x0 = 0, x1 = mask.width() - 1;
+    while (x0 <= x1 && !line[x0]) ++x0;
+    if (x0 > x1) continue;
+    while (!line[x1]) --x1;
+
+    left = qMin(left, x0);
+    right = qMax(right, x1);
+    if (top < 0) top = y;
+    bottom = y;
+  }
+  if (top < 0) return QRect(QPoint(0, 0), mask.size());
+
+  // the ring around the mask keeps the arcs into the masked pixels next to it,
+  // which seeds there may use, and the rows start on a word of the masks
+  left = qMax(0, left - 1) & ~63;
+  right = qMin(mask.width(), (right + 65) & ~63) - 1;
+  return QRect(QPoint(left, qMax(0, top - 1)), QPoint(right, qMin(mask.height() - 1, bottom + 1)));
+}
+
+// the part of a mask under a region of regionOf, its left side is on a word boundary
+static Matrix<bool> crop(const Matrix<uint8_t>& mask, const QRect& roi) {
+  if (mask.isNull()) return Matrix<bool>();
+
+  Matrix<bool> part(roi.size(), false);
+  for (int y = 0; y < roi.height(); ++y) {
+    const uint8_t* line = mask.line(roi.y() + y) + roi.x();
+    for (int x = 0; x < roi.width(); ++x) {
+      if (line[x]) part(x, y) = true;
+    }
+  }
+  return part;
+}
+
+static Matrix<bool> crop(const Matrix<bool>& mask, const QRect& roi) {
+  if (mask.isNull() || mask.size() == roi.size()) return mask;
+
+  Matrix<bool> part(roi.size(), false);
+  for (int y = 0; y < roi.height(); ++y) {
+    const Matrix<bool>::word_t* words = mask.line(roi.y() + y) + roi.x() / 64;
+    copy(words, words + part.wordsPerLine(), part.line(y));
+  }
+  return part;
+}
+
+/* NLinks */
+NLinks::NLinks(const QImage& image, GraphBase::Connectivity connectivity, int threads):
+  size_(image.size()),
+  pixels_(image.width()*image.height()),
+  connectivity_(connectivity)
+{
   Q_ASSERT(image.format() == QImage::Format::Format_RGB888);
+  Trace::Scope scope("nlinks");
 
-  static const int dx[] = {-1, 1, 0, 0, 1, -1, 1, 1 };
-  static const int dy[] = {0, 0, 1, -1, 1, 1, -1, -1};
+  const int half = static_cast<int>(connectivity) / 2, w = image.width(), h = image.height();
+  const int* dx = (half == 2 ? dx4 : dx8) + half;
+  const int* dy = (half == 2 ? dy4 : dy8) + half;
+  planes_.assign(size_t(half)*pixels_, 0.0f);
 
-  auto norm = [](const QRgb& lhs, const QRgb& rhs) -> float {
-    float r1 = qRed(lhs), g1 = qGreen(lhs), b1 = qBlue(lhs);
-    float r2 = qRed(rhs), g2 = qGreen(rhs), b2 = qBlue(rhs);
-    return qSqrt((r1-r2)*(r1-r2) + (g1-g2)*(g1-g2) + (b1-b2)*(b1-b2));
-  };
-  auto length = [](const int& x, const int& y) -> float {
-    return qSqrt(1.0f*x*x + 1.0f*y*y);
-  };
+  // the planes of a row are written by one band only
+  int bands = qMax(1, qMin(h, 4*qMax(1, threads)));
+  float* planes = planes_.data();
+  parallelFor(bands, threads, [&](int band) {
+    for (int y = band*h / bands; y < (band + 1)*h / bands; ++y) {
+      const uchar* line = image.constScanLine(y);
+      for (int k = 0; k < half; ++k) {
+        if (y + dy[k] >= h) continue;
 
-  int edges = 0;
-  float sigma = 2.0f;
-  Graph graph(image.width()*image.height(), image.size());
-  for (int y = 0; y<image.height(); ++y) {
-    for (int x = 0; x<image.width(); ++x) {
-      if (!mask.isNull() && !mask(x, y)) continue;
-
-      for (int i = 0; i<static_cast<int>(connectivity); ++i) {
-        int index = x + y*image.width();
-        auto p = image.pixel(x, y);
-        if (x + dx[i] >= 0 && x + dx[i]<image.width() && y + dy[i] >= 0 && y + dy[i]<image.height()) {
-          auto q = image.pixel(x + dx[i], y + dy[i]);
-          float weight = exp(-norm(p, q) / (2.0f*sigma)) / length(dx[i], dy[i]);
-
-          graph.addEdge(index, (x + dx[i]) + (y + dy[i])* image.width(), weight);
-          ++edges;
+        const uchar* next = image.constScanLine(y + dy[k]);
+        int x0 = qMax(0, -dx[k]), x1 = qMin(w, w - dx[k]);
+        float* row = planes + size_t(k)*pixels_ + size_t(y)*w;
+        for (int x = x0; x < x1; ++x) {
+          const uchar* p = line + 3*x;
+          const uchar* q = next + 3*(x + dx[k]);
+          int r = p[0] - q[0], g = p[1] - q[1], b = p[2] - q[2];
+          row[x] = float(r*r + g*g + b*b);
         }
+        simd::nlinkWeights(row + x0, row + x0, x1 - x0, sigma, qSqrt(float(dx[k]*dx[k] + dy[k]*dy[k])));
       }
     }
-  }
+  });
+}
+
+bool NLinks::isNull() const {
+  return pixels_ == 0;
+}
+
+QSize NLinks::size() const {
+  return size_;
+}
+
+GraphBase::Connectivity NLinks::connectivity() const {
+  return connectivity_;
+}
+
+const float* NLinks::plane(int k) const {
+  return planes_.data() + size_t(k)*pixels_;
+}
+
+// Number of row bands the grid is split into for construction, a few per
+// thread so that the bands left over at the end are short.
+template <class Cap>
+int BasicGraph<Cap>::rowBands(int height) const {
+  return qMax(1, qMin(height, 4*threads_));
+}
+
+// A QVector allocates less than 2^31 bytes with its header, the widest node
+// array is of sum_t and has two more items for the terminals.
+template <class Cap>
+qint64 BasicGraph<Cap>::maxPixels(Connectivity connectivity) {
+  const qint64 most = std::numeric_limits<int>::max();
+  qint64 arcs = most / static_cast<int>(connectivity);
+  qint64 nodes = (most - 64) / qint64(qMax(sizeof(sum_t), sizeof(int))) - 2;
+  return qMin(arcs, nodes);
+}
+
+template <class Cap>
+BasicGraph<Cap> BasicGraph<Cap>::fromImage(const QImage& image, const Matrix<uint8_t>& mask, const Connectivity& connectivity,
+                                            int threads, Precision precision) {
+  Q_ASSERT(image.format() == QImage::Format::Format_RGB888);
+  Trace::Scope scope("graph.fromImage");
+
+  const int* dx = connectivity == Connectivity::Four ? dx4 : dx8;
+  const int* dy = connectivity == Connectivity::Four ? dy4 : dy8;
+  QRect roi = mask.isNull() ? QRect(QPoint(0, 0), image.size()) : regionOf(mask);
+  return fromRows(image.size(), roi, mask, connectivity, threads, precision,
+                  [&](int y, int k, int x0, int x1, float* weights, quint16* codes) {
+    // the squared distances are turned into the weights in place
+    const uchar* line = image.constScanLine(y);
+    const uchar* next = image.constScanLine(y + dy[k]);
+    for (int x = x0; x < x1; ++x) {
+      const uchar* p = line + 3*x;
+      const uchar* q = next + 3*(x + dx[k]);
+      int r = p[0] - q[0], g = p[1] - q[1], b = p[2] - q[2];
+      weights[x - x0] = float(r*r + g*g + b*b);
+    }
+
+    float length = qSqrt(float(dx[k]*dx[k] + dy[k]*dy[k]));
+    if (codes) {
+      // the logarithm of the weight needs no exp
+      for (int x = x0; x < x1; ++x) {
+        float log_weight = -qSqrt(weights[x - x0]) / (2*sigma) - qLn(length);
+        codes[x - x0] = quint16(qMin(qRound((16 - log_weight)*512), zero_code - 1));
+      }
+    }
+    else simd::nlinkWeights(weights, weights, x1 - x0, sigma, length);
+  });
+}
+
+template <class Cap>
+BasicGraph<Cap> BasicGraph<Cap>::fromWeights(const NLinks& weights, const Matrix<uint8_t>& mask, int threads, Precision precision) {
+  Trace::Scope scope("graph.fromWeights");
+  const int w = weights.size().width(), half = static_cast<int>(weights.connectivity()) / 2;
+  QRect roi = mask.isNull() ? QRect(QPoint(0, 0), weights.size()) : regionOf(mask);
+  return fromRows(weights.size(), roi, mask, weights.connectivity(), threads, precision,
+                  [&](int y, int k, int x0, int x1, float* row, quint16* codes) {
+    const float* plane = weights.plane(k - half) + y*w;
+    if (codes) {
+      for (int x = x0; x < x1; ++x) codes[x - x0] = encode(plane[x]);
+    }
+    else copy(plane + x0, plane + x1, row);
+  });
+}
+
+template <class Cap>
+template <class Row>
+BasicGraph<Cap> BasicGraph<Cap>::fromRows(const QSize& size, const QRect& roi, const Matrix<uint8_t>& mask,
+                                          const Connectivity& connectivity, int threads, Precision precision, Row row) {
+  Q_ASSERT(qint64(roi.width())*roi.height() <= maxPixels(connectivity) && "cut larger images with TiledCut");
+  BasicGraph graph(roi.size(), connectivity, threads, precision);
+  graph.roi_ = roi;
+  graph.full_size_ = size;
+  const int k_count = graph.connectivity_;
+  const int* dx = k_count == 4 ? dx4 : dx8;
+  const int* dy = k_count == 4 ? dy4 : dy8;
+  const int w = roi.width(), h = roi.height(), left = roi.x(), top = roi.y();
+
+  // every undirected pair is weighted once, from the pixel with the lower index:
+  // the second half of the slots points forward, the reverse arc gets the same weight.
+  // A band writes the forward slots of its rows and the reverse slots of the next
+  // row, no slot is written twice, so the bands need no locking. A compact grid
+  // keeps the forward code only and detaches the masked pixels instead.
+  int bands = graph.rowBands(h);
+  QVector<int> edges(bands, 0);
+  flow_t* weight = graph.weight_.data();
+  quint16* codes = graph.codes_.data();
+  quint16* links = graph.links_.data();
+  const int pixels = graph.size_;
+  const bool compact = precision == Precision::Compact;
+  parallelFor(bands, graph.threads_, [&](int band) {
+    QVector<float> weights(w);
+    int y0 = band*h / bands, y1 = (band + 1)*h / bands;
+    for (int y = y0; y < y1; ++y) {
+      const uint8_t* mask_line = mask.isNull() ? nullptr : mask.line(top + y) + left;
+      if (compact && mask_line) {
+        for (int x = 0; x < w; ++x) {
+          if (!mask_line[x]) links[x + y*w] |= Detached;
+        }
+      }
 
-  graph.mask_ = mask.to<bool>();
-  qDebug() << "New graph:\n" << "  nodes:" << graph.size_ << "\n   edges:" << edges << "\n";
+      for (int k = k_count / 2; k < k_count; ++k) {
+        int ny = y + dy[k];
+        if (ny >= h) continue;
+
+        const uint8_t* next_mask = mask.isNull() ? nullptr : mask.line(top + ny) + left;
+        int x0 = qMax(0, -dx[k]), x1 = qMin(w, w - dx[k]);
+        row(top + y, k, left + x0, left + x1, weights.data(),
+            compact ? codes + size_t(k - k_count / 2)*pixels + y*w + x0 : nullptr);
+
+        for (int x = x0; x < x1; ++x) {
+          int i = x + y*w, a = i*k_count + k;
+          flow_t value = compact ? 0 : Traits::capacity(weights[x - x0]);
+          if (!mask_line || mask_line[x]) {
+            if (!compact) weight[a] = value;
+            ++edges[band];
+          }
+          if (!next_mask || next_mask[x + dx[k]]) {
+            if (!compact) weight[graph.sister(a)] = value;
+            ++edges[band];
+          }
+        }
+      }
+    }
+  });
+
+  graph.mask_ = crop(mask, roi);
+  Trace::count("graph.nodes", graph.size_);
+  Trace::count("graph.edges", accumulate(edges.begin(), edges.end(), 0));
+  qDebug() << "New graph:\n" << "  nodes:" << graph.size_ << "\n   edges:" << accumulate(edges.begin(), edges.end(), 0) << "\n";
   return graph;
 }
 
+template <class Cap>
+int BasicGraph<Cap>::pixel(int i) const {
+  if (full_size_ == image_size_) return i;
+  const int w = image_size_.width();
+  return roi_.x() + i % w + (roi_.y() + i / w)*full_size_.width();
+}
+
+template <class Cap>
+QVector<int> BasicGraph<Cap>::nodes(const QVector<int>& pixels) const {
+  if (full_size_ == image_size_) return pixels;
+  QVector<int> result;
+  result.reserve(pixels.size());
+  for (auto p : pixels) {
+    QPoint point(p % full_size_.width(), p / full_size_.width());
+    if (roi_.contains(point)) {
+      result << point.x() - roi_.x() + (point.y() - roi_.y())*image_size_.width();
+    }
+  }
+  return result;
+}
+
+// Lays out edges collected by addEdge as CSR arcs, pairing every
+// edge with its reverse. Grid graphs are laid out on construction.
+template <class Cap>
+void BasicGraph<Cap>::build() {
+  if (built_ || connectivity_) return;
+  built_ = true;
+
+  // the last capacity given for a directed edge wins
+  QVector<int> order(pending_.size());
+  for (int i = 0; i < order.size(); ++i) order[i] = i;
+  stable_sort(order.begin(), order.end(), [this](int lhs, int rhs) {
+    return pending_[lhs] < pending_[rhs];
+  });
+
+  QVector<int> directed;
+  for (int i = 0; i < order.size(); ++i) {
+    if (i + 1 < order.size() && pending_[order[i]] == pending_[order[i + 1]]) continue;
+    if (pending_[order[i]].first != pending_[order[i]].second) {
+      directed << order[i];
+    }
+  }
+
+  QVector<QPair<int, int>> pairs;
+  for (auto e : directed) {
+    const auto& edge = pending_[e];
+    pairs << qMakePair(qMin(edge.first, edge.second), qMax(edge.first, edge.second));
+  }
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+  first_.fill(0, size_ + 1);
+  for (auto& p : pairs) {
+    ++first_[p.first + 1];
+    ++first_[p.second + 1];
+  }
+  for (int i = 0; i < size_; ++i) {
+    first_[i + 1] += first_[i];
+  }
+
+  // pairs are sorted, so every node gets its arcs in increasing order of head
+  int arcs = first_[size_];
+  QVector<int> pos(first_);
+  QVector<int> lower(pairs.size());
+  head_.resize(arcs);
+  sister_.resize(arcs);
+  weight_.assign(arcs, -1);
+  for (int k = 0; k < pairs.size(); ++k) {
+    int u = pairs[k].first, v = pairs[k].second;
+    int a = pos[u]++, b = pos[v]++;
+    head_[a] = v;
+    head_[b] = u;
+    sister_[a] = b;
+    sister_[b] = a;
+    lower[k] = a;
+  }
+
+  for (auto e : directed) {
+    const auto& edge = pending_[e];
+    auto key = qMakePair(qMin(edge.first, edge.second), qMax(edge.first, edge.second));
+    int a = lower[lower_bound(pairs.begin(), pairs.end(), key) - pairs.begin()];
+    weight_[edge.first < edge.second ? a : sister_[a]] = Traits::capacity(pending_caps_[e]);
+  }
+}
+
+// Contracts the seeds of a fresh run, cap_ has to hold the n-links already.
+template <class Cap>
+void BasicGraph<Cap>::setTerminals(const QVector<int>& sources, const QVector<int>& sinks) {
+  source_cap_.fill(0, size_);
+  sink_cap_.fill(0, size_);
+  terminals_.fill(0, size_);
+  sources_.clear();
+  sinks_.clear();
+  changed_.clear();
+
+  updateTerminals(sources, sinks);
+
+  for (auto i : changed_) terminals_[i] &= ~Changed;
+  changed_.clear();
+
+  source_nodes_.clear();
+  for (int i = 0; i < size_; ++i) {
+    if (source_cap_[i] > Traits::epsilon()) source_nodes_ << i;
+  }
+}
+
+template <class Cap>
+typename BasicGraph<Cap>::Side BasicGraph<Cap>::sideOf(int i) const {
+  int seeds = terminals_[i] & (SourceArc | SinkArc);
+  return seeds == SourceArc ? SourceSide : seeds == SinkArc ? SinkSide : NoSide;
+}
+
+// Moves node 'i' from side 'from' to side 'to' and from the mask state
+// 'was_active' to 'active', the other nodes are where their flags say. The
+// flow stays feasible, so a reused BK run goes on from it.
+template <class Cap>
+void BasicGraph<Cap>::contract(int i, Side from, Side to, bool was_active, bool active) {
+  // capacity from the source (or to the sink, if negative) that an unseeded
+  // node gets from a seed next to it; 'in' is the arc into the node
+  auto terminal = [](Side seed, flow_t in, flow_t out) -> sum_t {
+    return seed == SourceSide ? sum_t(in) : seed == SinkSide ? -sum_t(out) : 0;
+  };
+
+  for (int a = first(i); a < first(i + 1); ++a) {
+    int j = head(a);
+    if (j < 0) continue;
+
+    int b = sister(a);
+    bool j_active = isActive(j);
+    flow_t out = qMax(weight(a), flow_t(0)), in = qMax(weight(b), flow_t(0));
+
+    if (sideOf(j) == NoSide) {
+      // n-links between unseeded nodes, an arc has capacity if its tail is active
+      flow_t before = from == NoSide && was_active ? out : 0, after = to == NoSide && active ? out : 0;
+      if (before != after) changeCapacity(a, before, after);
+      before = from == NoSide && j_active ? in : 0;
+      after = to == NoSide && j_active ? in : 0;
+      if (before != after) changeCapacity(b, before, after);
+
+      sum_t delta = j_active ? terminal(to, out, in) - terminal(from, out, in) : 0;
+      if (delta != 0) shiftTerminal(j, delta);
+    }
+    else {
+      sum_t before = from == NoSide && was_active ? terminal(sideOf(j), in, out) : 0;
+      sum_t after = to == NoSide && active ? terminal(sideOf(j), in, out) : 0;
+      if (before != after) shiftTerminal(i, after - before);
+    }
+  }
+}
+
+// Makes an active node a seed of 'to' or an unseeded one, if 'to' is NoSide.
+template <class Cap>
+void BasicGraph<Cap>::reseed(int i, Side to) {
+  Side from = sideOf(i);
+  if (from == to) return;
+  terminals_[i] = (terminals_[i] & ~(SourceArc | SinkArc)) | to;
+  contract(i, from, to, true, true);
+}
+
+// Masked out nodes keep their arcs, but have no capacity in the direction out of them.
+template <class Cap>
+bool BasicGraph<Cap>::isActive(int i) const {
+  return mask_.isNull() || mask_(i % image_size_.width(), i / image_size_.width());
+}
+
+// An arc is part of the residual graph once it was added or got a reverse flow.
+// Masked out nodes are dead ends: a reused flow may have left residual capacity
+// on their arcs, which a fresh run doesn't have.
+template <class Cap>
+bool BasicGraph<Cap>::hasArc(int i, int a) const {
+  return isActive(i) && (weight(a) >= 0 || cap_[a] > 0);
+}
+
 // Returns true if there is a path from source 's'
 // to sink 't' in residual graph.
-int Graph::bfs(int s, int t) {
+template <class Cap>
+template <int K>
+int BasicGraph<Cap>::bfs(int s, int t) {
   visited_.fill(false);
 
-  QQueue<int> q;
-  q << s;
-
+  int begin = 0, end = 0;
   parent_[s] = -1;
   visited_[s] = true;
 
-  while (!q.empty()) {
-    int u = q.front();
-    q.pop_front();
+  for (auto v : source_nodes_) {
+    if (!visited_[v] && qAbs(source_cap_[v])>Traits::epsilon()) {
+      queue_[end++] = v;
+      parent_[v] = -1;
+      visited_[v] = true;
+    }
+  }
 
-    for (auto& v : r_edges_[u].keys()) {
-      if (!visited_[v] && qAbs(r_edges_[u][v])>Float::epsilon()) {
-        q << v;
-        parent_[v] = u;
+  while (begin != end) {
+    int u = queue_[begin++];
+
+    for (int a = first<K>(u); a < first<K>(u + 1); ++a) {
+      int v = head<K>(a);
+      if (v >= 0 && !visited_[v] && qAbs(cap_[a])>Traits::epsilon()) {
+        queue_[end++] = v;
+        parent_[v] = a;
         visited_[v] = true;
-        if (v == t) q.clear();
       }
     }
+
+    // the sink has the largest index, so it is the last neighbour visited
+    if (qAbs(sink_cap_[u])>Traits::epsilon()) {
+      parent_[t] = u;
+      visited_[t] = true;
+      break;
+    }
   }
 
   // if we reached sink in BFS starting from source, then return true, else false
   return (visited_[t] == true);
 }
 
-void Graph::dfs(int s) {
+template <class Cap>
+void BasicGraph<Cap>::dfs(int s) {
   QStack<int> stack;
   stack.push(s);
+  visited_[s] = true;
+
+  for (auto v : source_nodes_) {
+    if (!visited_[v] && qAbs(source_cap_[v])>Traits::epsilon()) {
+      stack.push(v);
+      visited_[v] = true;
+    }
+  }
 
   while (!stack.isEmpty()) {
-    int s = stack.pop();
-    visited_[s] = true;
+    int u = stack.pop();
+    if (u >= size_) continue;
 
-    for (auto e : r_edges_[s].keys()) {
-      if (!visited_[e] && qAbs(r_edges_[s][e])>Float::epsilon()) {
-        stack.push(e);
+    for (int a = first(u); a < first(u + 1); ++a) {
+      int v = head(a);
+      if (v >= 0 && !visited_[v] && qAbs(cap_[a])>Traits::epsilon()) {
+        stack.push(v);
+        visited_[v] = true;
       }
     }
+
+    if (!visited_[size_ + 1] && qAbs(sink_cap_[u])>Traits::epsilon()) {
+      visited_[size_ + 1] = true;
+    }
   }
 }
 
-void Graph::setMask(const mask_t& mask) {
+template <class Cap>
+void BasicGraph<Cap>::setMask(const mask_t& full_mask) {
+  Trace::Scope scope("graph.setMask");
+  mask_t mask = crop(full_mask, roi_);
+  if (solved_) {
+    // seeds that get masked out are unseeded first, so the seeds stay active
+    for (auto i : sources_ + sinks_) {
+      if (mask.isNull() || mask(i % image_size_.width(), i / image_size_.width())) continue;
+      reseed(i, NoSide);
+      terminals_[i] &= ~(SourceArc | SinkArc);
+    }
+
+    // nodes that changed their state are found a word at a time
+    mask_t all(image_size_, true);
+    mask_t changed = (mask.isNull() ? all : mask) ^ (mask_.isNull() ? all : mask_);
+    for (int y = 0; y < changed.height(); ++y) {
+      const mask_t::word_t* words = changed.line(y);
+      for (int w = 0; w < changed.wordsPerLine(); ++w) {
+        for (mask_t::word_t bits = words[w]; bits; bits &= bits - 1) {
+          int i = w*64 + trailingZeros(bits) + y*image_size_.width();
+          bool was = isActive(i);
+          contract(i, NoSide, NoSide, was, !was);
+        }
+      }
+    }
+  }
+
   mask_ = mask;
 }
 
-void Graph::addEdge(int i, int j, float capacity) {
-  edges_[i][j] = capacity;
+template <class Cap>
+quint16 BasicGraph<Cap>::encode(float weight) {
+  if (!(weight > 0)) return zero_code;
+  return quint16(qBound(0, qRound((16 - qLn(weight))*512), zero_code - 1));
 }
 
-Graph::cut_t Graph::minCut(const QVector<int>& sources, const QVector<int>& sinks) {
-  int source = edges_.size(), sink = edges_.size() + 1;
+template <class Cap>
+void BasicGraph<Cap>::setWeight(int a, float weight) {
+  if (!decode_) {
+    weight_[a] = Traits::capacity(weight);
+    return;
+  }
 
-  edges_ << QMap<int, flow_t>();
-  edges_ << QMap<int, flow_t>();
+  int i = a >> shift_, k = a & (connectivity_ - 1), half = connectivity_ / 2;
+  if (k < half) {
+    i += offset_[k];
+    k = connectivity_ - 1 - k;
+  }
+  codes_[(k - half)*size_ + i] = encode(weight);
+}
 
-  for (auto s : sources) {
-    if (mask_.isNull() || mask_(s % image_size_.width(), s / image_size_.width())) {
-      edges_[source][s] = 100500;
+template <class Cap>
+void BasicGraph<Cap>::addEdge(int i, int j, float capacity) {
+  if (!connectivity_) {
+    pending_ << qMakePair(i, j);
+    pending_caps_ << capacity;
+  }
+
+  if (built_ || connectivity_) {
+    for (int a = first(i); a < first(i + 1); ++a) {
+      if (head(a) == j) {
+        // the arcs of a seed are terminal arcs of its neighbours
+        Side sides[] = {NoSide, NoSide};
+        if (solved_) {
+          sides[0] = sideOf(i);
+          sides[1] = sideOf(j);
+          reseed(i, NoSide);
+          reseed(j, NoSide);
+        }
+
+        flow_t from = qMax(weight(a), flow_t(0));
+        setWeight(a, capacity);
+        flow_t to = qMax(weight(a), flow_t(0));
+        if (solved_ && isActive(i)) changeCapacity(a, from, to);
+
+        // a compact grid keeps one weight for both directions
+        if (decode_ && solved_ && isActive(j) && weight(sister(a)) >= 0) {
+          changeCapacity(sister(a), from, to);
+        }
+
+        if (solved_) {
+          reseed(j, sides[1]);
+          reseed(i, sides[0]);
+        }
+        return;
+      }
+    }
+
+    // a new pair of arcs: the CSR has to be laid out and solved again
+    Q_ASSERT(!connectivity_ && "grid graphs only link neighbouring pixels");
+    built_ = solved_ = false;
+  }
+}
+
+template <class Cap>
+bool BasicGraph<Cap>::isNull() const {
+  return !size_;
+}
+
+template <class Cap>
+int BasicGraph<Cap>::nodeCount() const {
+  return size_;
+}
+
+template <class Cap>
+int BasicGraph<Cap>::arcCount() const {
+  if (!connectivity_ && !built_) return pending_.size();
+
+  int count = 0;
+  for (int a = 0; a < first(size_); ++a) {
+    if (head(a) >= 0 && weight(a) >= 0) ++count;
+  }
+  return count;
+}
+
+template <class Cap>
+int BasicGraph<Cap>::augmentations() const {
+  return augmentations_;
+}
+
+template <class Cap>
+void BasicGraph<Cap>::setProgress(const progress_t& progress) {
+  progress_ = progress;
+}
+
+template <class Cap>
+bool BasicGraph<Cap>::isInterrupted() const {
+  return interrupted_;
+}
+
+template <class Cap>
+bool BasicGraph<Cap>::cancelled() {
+  if (progress_ && !progress_(augmentations_, flow_)) {
+    interrupted_ = true;
+  }
+
+  return interrupted_;
+}
+
+template <class Cap>
+void BasicGraph<Cap>::edmondsKarp() {
+  switch (connectivity_) {
+  case 4: edmondsKarp<4>(); break;
+  case 8: edmondsKarp<8>(); break;
+  default: edmondsKarp<0>(); break;
+  }
+}
+
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::edmondsKarp() {
+  int source = size_, sink = size_ + 1;
+  queue_.resize(size_);
+
+  while (!cancelled() && bfs<K>(source, sink)) {
+    ++augmentations_;
+    sum_t path_flow = sink_cap_[parent_[sink]];
+    int v = parent_[sink];
+    for (; parent_[v] >= 0; v = head<K>(sister<K>(parent_[v]))) {
+      path_flow = qMin(path_flow, sum_t(cap_[parent_[v]]));
+      ++path_length_;
+    }
+    path_flow = qMin(path_flow, source_cap_[v]);
+    flow_ += path_flow / double(Traits::scale());
+
+    // update residual capacities of the edges and reverse edges along the path
+    v = parent_[sink];
+    sink_cap_[v] -= path_flow;
+    terminals_[v] |= SinkFlow;
+    for (; parent_[v] >= 0; v = head<K>(sister<K>(parent_[v]))) {
+      int a = parent_[v];
+      cap_[a] -= flow_t(path_flow);
+      cap_[sister<K>(a)] += flow_t(path_flow);
+    }
+    source_cap_[v] -= path_flow;
+    terminals_[v] |= SourceFlow;
+  }
+}
+
+// Boykov-Kolmogorov: source and sink search trees are grown towards each other
+// and repaired after every augmentation instead of being rebuilt from scratch.
+// The parent of a tree node is the arc from the node to its parent.
+template <class Cap>
+void BasicGraph<Cap>::boykovKolmogorov(bool reuse_trees) {
+  if (reuse_trees) {
+    for (auto i : changed_) {
+      terminals_[i] &= ~Changed;
+      repair(i);
+    }
+    changed_.clear();
+  }
+  else {
+    initTrees();
+  }
+
+  switch (connectivity_) {
+  case 4: boykovKolmogorov<4>(); break;
+  case 8: boykovKolmogorov<8>(); break;
+  default: boykovKolmogorov<0>(); break;
+  }
+}
+
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::boykovKolmogorov() {
+  int current = -1;
+  while (true) {
+    if (!orphans_.isEmpty()) {
+      int i = orphans_.dequeue();
+      if (parent_[i] == OrphanParent) adopt<K>(i);
+      continue;
+    }
+
+    int i = current;
+    if (i >= 0) {
+      active_[i] = false;
+      if (parent_[i] == NoParent) i = -1;
+    }
+    if (i < 0 && (i = nextActive()) < 0) break;
+
+    int a = grow<K>(i);
+    if ((++time_ & 1023) == 0 && cancelled()) break;
+
+    if (a >= 0) {
+      // keep growing from the same node after the trees are repaired
+      active_[i] = true;
+      current = i;
+      augment<K>(a);
+    }
+    else current = -1;
+  }
+}
+
+template <class Cap>
+void BasicGraph<Cap>::initTrees() {
+  tree_.fill(Free, size_);
+  parent_.fill(NoParent);
+  active_.fill(false, size_);
+  dist_.fill(0, size_);
+  stamp_.fill(0, size_);
+  queue_.resize(size_ + 1);
+  queue_first_ = queue_last_ = 0;
+  orphans_.clear();
+  time_ = 0;
+
+  for (int i = 0; i < size_; ++i) {
+    // push what can go straight through the node
+    sum_t through = qMin(source_cap_[i], sink_cap_[i]);
+    if (through > 0) {
+      source_cap_[i] -= through;
+      sink_cap_[i] -= through;
+      terminals_[i] |= SourceFlow | SinkFlow;
+    }
+
+    if (source_cap_[i] > Traits::epsilon()) {
+      tree_[i] = SourceTree;
+    }
+    else if (sink_cap_[i] > Traits::epsilon()) {
+      tree_[i] = SinkTree;
+    }
+    else continue;
+
+    parent_[i] = TerminalParent;
+    dist_[i] = 1;
+    activate(i);
+  }
+}
+
+template <class Cap>
+void BasicGraph<Cap>::activate(int i) {
+  if (active_[i]) return;
+
+  active_[i] = true;
+  queue_[queue_last_] = i;
+  queue_last_ = (queue_last_ + 1) % queue_.size();
+}
+
+template <class Cap>
+int BasicGraph<Cap>::nextActive() {
+  while (queue_first_ != queue_last_) {
+    int i = queue_[queue_first_];
+    queue_first_ = (queue_first_ + 1) % queue_.size();
+    active_[i] = false;
+    if (parent_[i] != NoParent) return i;
+  }
+
+  return -1;
+}
+
+// Grows the tree of node 'i' by its free neighbours. Returns
+// the arc from the source tree to the sink tree if the trees met.
+template <class Cap>
+template <int K>
+int BasicGraph<Cap>::grow(int i) {
+  bool source_tree = tree_[i] == SourceTree;
+  for (int a = first<K>(i); a < first<K>(i + 1); ++a) {
+    int j = head<K>(a);
+    if (j < 0 || (source_tree ? cap_[a] : cap_[sister<K>(a)]) <= Traits::epsilon()) continue;
+
+    if (parent_[j] == NoParent) {
+      tree_[j] = tree_[i];
+      parent_[j] = sister<K>(a);
+      stamp_[j] = stamp_[i];
+      dist_[j] = dist_[i] + 1;
+      activate(j);
+    }
+    else if (tree_[j] != tree_[i]) {
+      return source_tree ? a : sister<K>(a);
+    }
+    else if (stamp_[j] <= stamp_[i] && dist_[j] > dist_[i]) {
+      // shorten the path of 'j' to its terminal
+      parent_[j] = sister<K>(a);
+      stamp_[j] = stamp_[i];
+      dist_[j] = dist_[i] + 1;
+    }
+  }
+
+  return -1;
+}
+
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::augment(int a) {
+  ++augmentations_;
+  flow_t path_flow = cap_[a];
+
+  int i = head<K>(sister<K>(a));
+  for (; parent_[i] != TerminalParent; i = head<K>(parent_[i])) {
+    path_flow = qMin(path_flow, cap_[sister<K>(parent_[i])]);
+    ++path_length_;
+  }
+  path_flow = flow_t(qMin(sum_t(path_flow), source_cap_[i]));
+
+  i = head<K>(a);
+  for (; parent_[i] != TerminalParent; i = head<K>(parent_[i])) {
+    path_flow = qMin(path_flow, cap_[parent_[i]]);
+    ++path_length_;
+  }
+  path_flow = flow_t(qMin(sum_t(path_flow), sink_cap_[i]));
+  flow_ += path_flow / double(Traits::scale());
+
+  cap_[a] -= path_flow;
+  cap_[sister<K>(a)] += path_flow;
+
+  // saturated arcs leave orphans behind
+  i = head<K>(sister<K>(a));
+  while (parent_[i] != TerminalParent) {
+    int p = parent_[i];
+    cap_[p] += path_flow;
+    cap_[sister<K>(p)] -= path_flow;
+    if (cap_[sister<K>(p)] <= Traits::epsilon()) {
+      parent_[i] = OrphanParent;
+      orphans_.prepend(i);
     }
+    i = head<K>(p);
+  }
+  source_cap_[i] -= path_flow;
+  terminals_[i] |= SourceFlow;
+  if (source_cap_[i] <= Traits::epsilon()) {
+    parent_[i] = OrphanParent;
+    orphans_.prepend(i);
   }
 
+  i = head<K>(a);
+  while (parent_[i] != TerminalParent) {
+    int p = parent_[i];
+    cap_[sister<K>(p)] += path_flow;
+    cap_[p] -= path_flow;
+    if (cap_[p] <= Traits::epsilon()) {
+      parent_[i] = OrphanParent;
+      orphans_.prepend(i);
+    }
+    i = head<K>(p);
+  }
+  sink_cap_[i] -= path_flow;
+  terminals_[i] |= SinkFlow;
+  if (sink_cap_[i] <= Traits::epsilon()) {
+    parent_[i] = OrphanParent;
+    orphans_.prepend(i);
+  }
+}
+
+// Looks for a new parent of orphan 'i' in its own tree, picking the
+// neighbour closest to the terminal. Frees the node if there is none.
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::adopt(int i) {
+  bool source_tree = tree_[i] == SourceTree;
+  int best = NoParent, best_dist = numeric_limits<int>::max();
+
+  for (int a = first<K>(i); a < first<K>(i + 1); ++a) {
+    int j = head<K>(a);
+    if (j < 0 || tree_[j] != tree_[i] || parent_[j] == NoParent) continue;
+    if ((source_tree ? cap_[sister<K>(a)] : cap_[a]) <= Traits::epsilon()) continue;
+
+    // walk up to the terminal, stopping at nodes already checked on this step
+    int d = 0, k = j;
+    while (true) {
+      if (stamp_[k] == time_) {
+        d += dist_[k];
+        break;
+      }
+
+      ++d;
+      if (parent_[k] == TerminalParent) {
+        stamp_[k] = time_;
+        dist_[k] = 1;
+        break;
+      }
+      if (parent_[k] == OrphanParent) {
+        d = numeric_limits<int>::max();
+        break;
+      }
+      k = head<K>(parent_[k]);
+    }
+
+    if (d == numeric_limits<int>::max()) continue;
+    if (d < best_dist) {
+      best = a;
+      best_dist = d;
+    }
+    for (k = j; stamp_[k] != time_; k = head<K>(parent_[k])) {
+      stamp_[k] = time_;
+      dist_[k] = d--;
+    }
+  }
+
+  if (best != NoParent) {
+    parent_[i] = best;
+    stamp_[i] = time_;
+    dist_[i] = best_dist + 1;
+    return;
+  }
+
+  for (int a = first<K>(i); a < first<K>(i + 1); ++a) {
+    int j = head<K>(a);
+    if (j < 0 || tree_[j] != tree_[i] || parent_[j] == NoParent) continue;
+
+    if ((source_tree ? cap_[sister<K>(a)] : cap_[a]) > Traits::epsilon()) activate(j);
+    int p = parent_[j];
+    if (p != TerminalParent && p != OrphanParent && head<K>(p) == i) {
+      parent_[j] = OrphanParent;
+      orphans_.enqueue(j);
+    }
+  }
+
+  parent_[i] = NoParent;
+  tree_[i] = Free;
+}
+
+// Sets the capacity of arc 'a' keeping the flow feasible. A flow above the new
+// capacity is cut back and the difference is moved to the terminal arcs of the
+// ends of the arc, which changes the cut by a constant only.
+template <class Cap>
+void BasicGraph<Cap>::changeCapacity(int a, flow_t from, flow_t to) {
+  int i = head(sister(a)), j = head(a);
+
+  cap_[a] += to - from;
+  if (cap_[a] < 0) {
+    flow_t excess = -cap_[a];
+    cap_[a] = 0;
+    cap_[sister(a)] -= excess;
+    shiftTerminal(i, excess);
+    shiftTerminal(j, -excess);
+  }
+
+  for (int k : {i, j}) {
+    if (!(terminals_[k] & Changed)) {
+      terminals_[k] |= Changed;
+      changed_ << k;
+    }
+  }
+}
+
+// Adds 'delta' to the residual from the source (or takes it from the residual
+// to the sink). Only the difference of the two terminal residuals matters.
+template <class Cap>
+void BasicGraph<Cap>::shiftTerminal(int i, sum_t delta) {
+  sum_t residual = source_cap_[i] - sink_cap_[i] + delta;
+  source_cap_[i] = qMax(residual, sum_t(0));
+  sink_cap_[i] = qMax(-residual, sum_t(0));
+
+  if (!(terminals_[i] & Changed)) {
+    terminals_[i] |= Changed;
+    changed_ << i;
+  }
+}
+
+// Applies the difference between the seeds of the previous run and the new ones.
+template <class Cap>
+void BasicGraph<Cap>::updateTerminals(const QVector<int>& sources, const QVector<int>& sinks) {
+  for (auto s : sources) {
+    if (isActive(s)) terminals_[s] |= SourceSeed;
+  }
   for (auto t : sinks) {
-    if (mask_.isNull() || mask_(t % image_size_.width(), t / image_size_.width())) {
-      edges_[t][sink] = 100500;
+    if (isActive(t)) terminals_[t] |= SinkSeed;
+  }
+
+  // the nodes are moved one by one, each move sees the new flags of the nodes before it
+  QVector<int> nodes = sources_ + sinks_ + sources + sinks;
+  for (auto i : nodes) {
+    uint8_t& flags = terminals_[i];
+    Side from = sideOf(i);
+    flags &= ~(SourceArc | SinkArc);
+    if (flags & SourceSeed) flags |= SourceArc;
+    if (flags & SinkSeed) flags |= SinkArc;
+    if (sideOf(i) != from) contract(i, from, sideOf(i), true, true);
+  }
+
+  sources_.clear();
+  sinks_.clear();
+  for (auto i : nodes) {
+    if (terminals_[i] & SourceSeed) sources_ << i;
+    if (terminals_[i] & SinkSeed) sinks_ << i;
+    terminals_[i] &= ~(SourceSeed | SinkSeed);
+  }
+
+  sort(sources_.begin(), sources_.end());
+  sources_.erase(unique(sources_.begin(), sources_.end()), sources_.end());
+  sort(sinks_.begin(), sinks_.end());
+  sinks_.erase(unique(sinks_.begin(), sinks_.end()), sinks_.end());
+}
+
+template <class Cap>
+void BasicGraph<Cap>::orphan(int i) {
+  parent_[i] = OrphanParent;
+  orphans_.enqueue(i);
+}
+
+// Fixes the search trees around a node whose capacities changed.
+template <class Cap>
+void BasicGraph<Cap>::repair(int i) {
+  Tree tree = source_cap_[i] > Traits::epsilon() ? SourceTree :
+              sink_cap_[i] > Traits::epsilon() ? SinkTree : Free;
+
+  if (tree != Free) {
+    // the node moves to the other tree, its subtree has to find new parents
+    // and the old neighbours may be on the boundary between the trees now
+    if (parent_[i] == NoParent || tree_[i] != tree) {
+      for (int a = first(i); a < first(i + 1); ++a) {
+        int j = head(a);
+        if (j < 0 || parent_[j] == NoParent) continue;
+        if (parent_[i] != NoParent && parent_[j] >= 0 && tree_[j] == tree_[i] && head(parent_[j]) == i) orphan(j);
+        // an orphan that stays in its tree may have residual into the node, which
+        // could have changed sides, so it has to grow again
+        activate(j);
+      }
     }
+
+    tree_[i] = tree;
+    parent_[i] = TerminalParent;
+    stamp_[i] = time_;
+    dist_[i] = 1;
+  }
+  else if (parent_[i] == TerminalParent) {
+    orphan(i);
+  }
+  else if (parent_[i] >= 0) {
+    int p = parent_[i];
+    if ((tree_[i] == SourceTree ? cap_[sister(p)] : cap_[p]) <= Traits::epsilon()) orphan(i);
   }
 
-  size_ = edges_.size();
-  parent_.resize(size_);
-  visited_.resize(size_);
+  activate(i);
+}
 
-  r_edges_ = edges_;
+template <class Cap>
+GraphBase::cut_t BasicGraph<Cap>::minCut(const QVector<int>& source_pixels, const QVector<int>& sink_pixels, Engine engine) {
+  static const char* stages[] = {"graph.edmondsKarp", "graph.boykovKolmogorov", "graph.pushRelabel"};
+  Trace::Scope scope("graph.minCut");
+  int source = size_;
 
-  while (bfs(source, sink)) {
-    float path_flow = Float::max();
-    for (int v = sink; v != source; v = parent_[v]) {
-      int u = parent_[v];
-      path_flow = qMin(path_flow, r_edges_[u][v]);
+  // seeds outside of the region of a grid are masked out anyway
+  QVector<int> sources = nodes(source_pixels), sinks = nodes(sink_pixels);
+
+  build();
+  augmentations_ = 0;
+  path_length_ = 0;
+  interrupted_ = false;
+
+  if (solved_ && engine == Engine::BoykovKolmogorov) {
+    {
+      Trace::Scope terminals("graph.terminals");
+      updateTerminals(sources, sinks);
     }
+    Trace::Scope flow(stages[int(engine)]);
+    boykovKolmogorov(true);
+  }
+  else {
+    {
+      Trace::Scope terminals("graph.terminals");
+      flow_ = 0;
+      cap_.resize(first(size_));
+      for (int i = 0; i < size_; ++i) {
+        bool active = isActive(i);
+        for (int a = first(i); a < first(i + 1); ++a) {
+          cap_[a] = active ? qMax(weight(a), flow_t(0)) : 0;
+        }
+      }
+      setTerminals(sources, sinks);
 
-    // update residual capacities of the edges and reverse edges along the path
-    for (int v = sink; v != source; v = parent_[v]) {
-      int u = parent_[v];
-      r_edges_[u][v] -= path_flow;
-      r_edges_[v][u] += path_flow;
+      parent_.resize(size_ + 2);
+      visited_.resize(size_ + 2);
+    }
+
+    Trace::Scope flow(stages[int(engine)]);
+    switch (engine) {
+    case Engine::EdmondsKarp:
+      edmondsKarp();
+      break;
+    case Engine::BoykovKolmogorov:
+      boykovKolmogorov();
+      break;
+    case Engine::PushRelabel:
+      // leaves a maximum preflow, the source side is marked by pushRelabel
+      pushRelabel();
+      break;
     }
+
+    solved_ = engine == Engine::BoykovKolmogorov;
   }
 
-  visited_.fill(false);
-  dfs(source);
+  // every Edmonds-Karp path is one BFS pass, push-relabel finds no paths
+  Trace::count("graph.augmentations", augmentations_);
+  if (augmentations_) Trace::count("graph.pathLength", double(path_length_) / augmentations_);
+  if (engine != Engine::PushRelabel) Trace::count("graph.flow", flow_);
 
+  if (interrupted_) {
+    // the flow is still valid, but the search trees may be half repaired
+    solved_ = false;
+    return cut_t();
+  }
+
+  Trace::Scope extract("graph.cut");
+
+  if (engine == Engine::BoykovKolmogorov) {
+    // the final source tree is everything reachable from the source
+    for (int i = 0; i < size_; ++i) {
+      visited_[i] = isActive(i) && tree_[i] == SourceTree && parent_[i] != NoParent;
+    }
+  }
+  else if (engine == Engine::EdmondsKarp) {
+    visited_.fill(false);
+    dfs(source);
+  }
+
+  // contracted seeds are isolated, they are on the side of their terminal
+  for (auto s : sources_) {
+    if (sideOf(s) == SourceSide) visited_[s] = true;
+  }
+  for (auto t : sinks_) {
+    if (sideOf(t) == SinkSide) visited_[t] = false;
+  }
+
+  if (engine != Engine::PushRelabel) {
+    // masked out nodes are dead ends, reached by any unsaturated arc into them;
+    // a reused flow may have moved terminal capacity onto them
+    for (int i = 0; i < size_ && !mask_.isNull(); ++i) {
+      for (int a = first(i); a < first(i + 1) && !isActive(i); ++a) {
+        int j = head(a);
+        if (j >= 0 && visited_[j] && isActive(j) && weight(sister(a)) > Traits::epsilon()) {
+          visited_[i] = true;
+          break;
+        }
+      }
+    }
+    visited_[source] = true;
+    visited_[size_ + 1] = false;
+  }
+
+  int sink = size_ + 1;
   QVector<QPair<int, int>> cut;
   for (int i = 0; i<size_; ++i) {
-    if (!visited_[i]) continue;
-    for (auto j : edges_[i].keys()) {
-      if (!visited_[j] && edges_[i][j]) {
+    if (!visited_[i] || !isActive(i)) continue;
+    for (int a = first(i); a < first(i + 1); ++a) {
+      int j = head(a);
+      // grid edges whose weight underflowed or was rounded to 0 are still
+      // crossed by traverse, so they are cut as well
+      if (j >= 0 && !visited_[j] && (connectivity_ || weight(a) > 0)) {
         cut.push_back(qMakePair(i, j));
       }
     }
+    if ((terminals_[i] & SinkArc) && !visited_[sink]) {
+      cut.push_back(qMakePair(i, sink));
+    }
+  }
+
+  for (auto s : sources_) {
+    if (!visited_[s]) {
+      cut.push_back(qMakePair(source, s));
+    }
   }
 
   return cut;
 }
 
-QVector<int> Graph::getForeground(const Graph::cut_t& indices) {
-  int source = edges_.size() - 2;
-  QVector<bool> cut(size_, false);
+// Marks nodes reachable from the source without
+// stepping on the ends of the cut edges.
+template <class Cap>
+void BasicGraph<Cap>::traverse(const cut_t& indices) {
+  int source = size_, sink = size_ + 1;
+  QVector<bool> cut(size_ + 2, false);
   QStack<int> stack;
   stack.push(source);
 
@@ -175,24 +1286,57 @@ QVector<int> Graph::getForeground(const Graph::cut_t& indices) {
     cut[e.first] = cut[e.second] = true;
   }
 
+  auto visit = [&](int s, int e) {
+    if (!visited_[e] && !cut[e] && !cut[s]) {
+      visited_[e] = true;
+      stack.push(e);
+    }
+  };
+
   visited_.fill(false);
+  visited_[source] = true;
   while (!stack.isEmpty()) {
     int s = stack.pop();
-    visited_[s] = true;
 
-    for (auto e : r_edges_[s].keys()) {
-      if (!visited_[e] && !cut[e] && !cut[s]) {
-        stack.push(e);
+    if (s == source) {
+      for (auto e : sources_) visit(s, e);
+    }
+    else if (s == sink) {
+      for (int e = 0; e < size_; ++e) {
+        if (terminals_[e] & SinkFlow) visit(s, e);
       }
     }
+    else {
+      for (int a = first(s); a < first(s + 1); ++a) {
+        if (head(a) >= 0 && hasArc(s, a)) visit(s, head(a));
+      }
+      if (terminals_[s] & SourceFlow) visit(s, source);
+      if (terminals_[s] & SinkArc) visit(s, sink);
+    }
+  }
+}
+
+template <class Cap>
+QVector<int> BasicGraph<Cap>::sourceSide() const {
+  QVector<int> nodes;
+  for (int i = 0; i < size_; ++i) {
+    if (visited_[i] && isActive(i)) nodes << pixel(i);
   }
 
+  return nodes;
+}
+
+template <class Cap>
+QVector<int> BasicGraph<Cap>::getForeground(const cut_t& indices) {
+  Trace::Scope scope("graph.getForeground");
+  traverse(indices);
+
   QVector<int> foreground;
-  for (int i = 0; i<visited_.size()-2; ++i) {
+  for (int i = 0; i<size_; ++i) {
     if (visited_[i]) {
       int y = i / image_size_.width(), x = i % image_size_.width();
       if (mask_.isNull() || mask_(x, y)) {
-        foreground.push_back(i);
+        foreground.push_back(pixel(i));
       }
     }
   }
@@ -200,37 +1344,49 @@ QVector<int> Graph::getForeground(const Graph::cut_t& indices) {
   return foreground;
 }
 
-QVector<int> Graph::getBackground(const Graph::cut_t& indices) {
-  int source = edges_.size() - 2;
-  QVector<bool> cut(size_, false);
-  QStack<int> stack;
-  stack.push(source);
+template <class Cap>
+void BasicGraph<Cap>::fillMask(const cut_t& indices, mask_t& mask) {
+  Q_ASSERT(connectivity_ && mask.size() == full_size_);
+  Trace::Scope scope("graph.fillMask");
+  traverse(indices);
 
-  for (auto &e : indices) {
-    cut[e.first] = cut[e.second] = true;
-  }
-
-  visited_.fill(false);
-  while (!stack.isEmpty()) {
-    int s = stack.pop();
-    visited_[s] = true;
-
-    for (auto e : r_edges_[s].keys()) {
-      if (!visited_[e] && !cut[e] && !cut[s]) {
-        stack.push(e);
+  // the visited flags of a row are packed a word at a time,
+  // the region starts on a word of the mask
+  const int w = image_size_.width();
+  for (int y = 0; y < image_size_.height(); ++y) {
+    const bool* visited = visited_.constData() + y*w;
+    const mask_t::word_t* active = mask_.isNull() ? nullptr : mask_.line(y);
+    mask_t::word_t* words = mask.line(roi_.y() + y) + roi_.x() / 64;
+    for (int k = 0; k < (w + 63) / 64; ++k) {
+      mask_t::word_t bits = 0;
+      for (int x = k*64, b = 0; x < w && b < 64; ++x, ++b) {
+        bits |= mask_t::word_t(visited[x]) << b;
       }
+
+      mask_t::word_t keep = active ? ~active[k] : 0;
+      words[k] = (words[k] & keep) | (bits & ~keep);
     }
   }
+}
+
+template <class Cap>
+QVector<int> BasicGraph<Cap>::getBackground(const cut_t& indices) {
+  Trace::Scope scope("graph.getBackground");
+  traverse(indices);
 
   QVector<int> background;
-  for (int i = 0; i<visited_.size() - 2; ++i) {
+  for (int i = 0; i<size_; ++i) {
     if (!visited_[i]) {
       int y = i / image_size_.width(), x = i % image_size_.width();
       if (mask_.isNull() || mask_(x, y)) {
-        background.push_back(i);
+        background.push_back(pixel(i));
       }
     }
   }
 
   return background;
 }
+
+template class BasicGraph<float>;
+template class BasicGraph<qint32>;
+template class BasicGraph<qint16>;
@@ -4,47 +4,385 @@
 #include <stdint.h>
 #include <QImage>
 #include <QPair>
-#include <QMap>
+#include <QQueue>
+#include <QThread>
+#include <functional>
+#include <atomic>
+#include <vector>
+
+class WorkerPool;
 
 using Float = std::numeric_limits<float>;
 
 #include "matrix.h"
 
-class Graph {
+// Arithmetic of the residual capacities. Integer capacities are the weights
+// scaled and rounded, so the flow is exact: residuals are tested against 0 and
+// the cut doesn't depend on the machine or the order of the additions. Terminal
+// residuals and excesses are kept in the wider sum_t.
+template <class T> struct CapacityTraits;
+
+template <> struct CapacityTraits<float> {
+  using sum_t = float;
+  static float epsilon() { return Float::epsilon(); }
+  static float scale() { return 1; }
+  static float capacity(float weight) { return weight; }
+};
+
+template <> struct CapacityTraits<qint32> {
+  using sum_t = qint64;
+  static qint32 epsilon() { return 0; }
+  static float scale() { return 65536; }
+  static qint32 capacity(float weight) {
+    return weight < 0 ? -1 : qint32(qMin(qRound64(double(weight)*scale()), qint64(1 << 30)));
+  }
+};
+
+// a weight of 1 is 2048, the residuals of two opposite arcs still fit in 16 bits
+template <> struct CapacityTraits<qint16> {
+  using sum_t = qint32;
+  static qint16 epsilon() { return 0; }
+  static float scale() { return 2048; }
+  static qint16 capacity(float weight) {
+    return weight < 0 ? -1 : qint16(qMin(qRound64(double(weight)*scale()), qint64(16383)));
+  }
+};
+
+// types shared by the graphs of all capacity types
+class GraphBase {
 public:
-  using flow_t = float;
   using cut_t = QVector<QPair<int, int>>;
   using mask_t = Matrix<bool>;
+  using progress_t = std::function<bool(int augmentations, double flow)>;
 
   enum class Connectivity {
     Four = 4,
     Eight = 8
   };
 
+  // storage of the n-link weights of a grid graph
+  enum class Precision {
+    Single, // a float per arc
+    Compact // 16 bits of the logarithm per undirected edge, both directions get the same weight
+  };
+
+  enum class Engine {
+    EdmondsKarp,
+    BoykovKolmogorov,
+    PushRelabel
+  };
+
+  // instantiation of BasicGraph picked by the tools at run time
+  enum class Capacity {
+    Float,
+    Int32,
+    Int16
+  };
+
+  // weight of the n-link between RGB888 pixels 'p' and 'q' at distance 'length', as in fromImage
+  static float nlinkWeight(const uchar* p, const uchar* q, float length);
+
+  // part of the image a grid over 'mask' covers: the bounding box of the set pixels
+  // and the ring around them widened to whole words of Matrix<bool>, the whole
+  // image if none is set
+  static QRect regionOf(const Matrix<uint8_t>& mask);
+};
+
+// N-link weights of an image, computed once for all of the graphs built over it
+// while the image stays the same. Plane 'k' holds the weight from every pixel to
+// its forward neighbour 'k', which is grid slot connectivity/2 + k, and 0 where
+// the neighbour is outside of the image. The mask is applied by the graphs.
+class NLinks {
+public:
+  NLinks() = default;
+  explicit NLinks(const QImage& image, GraphBase::Connectivity connectivity = GraphBase::Connectivity::Four,
+                  int threads = QThread::idealThreadCount());
+
+  bool isNull() const;
+  QSize size() const;
+  GraphBase::Connectivity connectivity() const;
+
+  // weight between pixel 'i' and its forward neighbour 'k', k < connectivity/2
+  float weight(int i, int k) const {
+    return planes_[size_t(k)*pixels_ + i];
+  }
+
+  const float* plane(int k) const;
+
 private:
+  QSize size_;
+  int pixels_ = 0;
+  GraphBase::Connectivity connectivity_ = GraphBase::Connectivity::Four;
+  std::vector<float> planes_; // may be over 2 GB, which a QVector can't hold
+};
+
+template <class Cap>
+class BasicGraph : public GraphBase {
+public:
+  using flow_t = Cap;
+  using Traits = CapacityTraits<Cap>;
+  using sum_t = typename Traits::sum_t;
+
+private:
+  enum TerminalFlags : uint8_t {
+    SourceArc = 1,  // i is a source seed
+    SinkArc = 2,    // i is a sink seed
+    SourceFlow = 4, // flow was pushed along source->i
+    SinkFlow = 8,   // flow was pushed along i->sink
+    Changed = 16,   // capacities changed since the last BK run
+    SourceSeed = 32, // seeds of the coming run
+    SinkSeed = 64
+  };
+
+  // A seed of one kind is contracted into its terminal: none of its arcs has
+  // capacity, and an arc between it and an unseeded node becomes a terminal
+  // arc of that node. A node seeded both ways stays unseeded.
+  enum Side : uint8_t { NoSide = 0, SourceSide = 1, SinkSide = 2 };
+
+  // bit 'k' of links_[i] is set if slot 'k' of pixel 'i' leads to a pixel,
+  // Detached is set if the pixel was masked out in fromImage
+  enum { Detached = 1 << 8 };
+
+  // search tree of a node and special parent arcs used by the BK engine
+  enum Tree : uint8_t { Free = 0, SourceTree = 1, SinkTree = 2 };
+  enum { NoParent = -1, TerminalParent = -2, OrphanParent = -3 };
+
   QVector<int> parent_;
   QVector<bool> visited_;
+  QVector<int> queue_;
+  QVector<uint8_t> tree_;
+  QVector<int> dist_;
+  QVector<int> stamp_;
+  QVector<bool> active_;
+  QQueue<int> orphans_;
+  int queue_first_ = 0, queue_last_ = 0;
+  int time_ = 0;
+  int augmentations_ = 0;
+  qint64 path_length_ = 0; // arcs of all augmenting paths, for the trace
+  double flow_ = 0;
+  progress_t progress_;
+  bool interrupted_ = false;
+  QVector<int> label_;
+  QVector<sum_t> excess_;
+  int threads_ = QThread::idealThreadCount();
   QSize image_size_;
+  // node 'i' of a grid is the pixel (i % width, i / width) of 'roi_'
+  // in an image of 'full_size_', see regionOf
+  QRect roi_;
+  QSize full_size_;
   mask_t mask_;
-  int size_;
+  int size_ = 0;
+  int connectivity_ = 0; // 0 for a general (non-grid) graph
+  bool built_ = false;
+  bool solved_ = false;  // flow and BK trees can be reused by the next minCut
+
+  // CSR arc store of a general graph: arcs of node i live in [first_[i], first_[i + 1])
+  // sorted by head. Grid graphs use fixed per-pixel slots and store no topology,
+  // slot 'k' of pixel 'i' is arc i*connectivity_ + k leading to i + offset_[k],
+  // its reverse is slot connectivity_ - 1 - k of that pixel. The arrays of the
+  // arcs are std::vectors: a QVector holds under 2 GB, 67 MP of an 8-connected grid.
+  QVector<int> first_;
+  std::vector<int> head_;
+  std::vector<int> sister_;
+  QVector<quint16> links_;
+  int offset_[8];
+  int shift_ = 0;
+  std::vector<flow_t> cap_;    // residual capacity
+  std::vector<flow_t> weight_; // capacity given to addEdge, negative if the arc was never added
+
+  // weights of a compact grid instead of weight_, plane k - connectivity_/2 holds
+  // the forward slot 'k' of every pixel, decode_ maps the codes to the weights
+  std::vector<quint16> codes_;
+  const flow_t* decode_ = nullptr;
+
+  // terminal arcs are kept apart from the n-links; the seeds are in sources_ and
+  // sinks_, the nodes with capacity from the source in source_nodes_
+  QVector<int> sources_;
+  QVector<int> sinks_;
+  QVector<int> source_nodes_;
+  QVector<sum_t> source_cap_;
+  QVector<sum_t> sink_cap_;
+  QVector<uint8_t> terminals_;
+  QVector<int> changed_;
+
+  // edges of a general graph collected by addEdge, the CSR is rebuilt from them
+  QVector<QPair<int, int>> pending_;
+  QVector<float> pending_caps_;
+
+  BasicGraph(const QSize& image_size, const Connectivity& connectivity, int threads, Precision precision);
+
+  int rowBands(int height) const;
+
+  // Grid over 'roi' of an image of 'size' masked by 'mask'. row(y, k, x0, x1, weights, codes)
+  // gives the forward weights of slot 'k' for the pixels x0..x1-1 of image row 'y'
+  // as weights[x - x0] or, if 'codes' isn't null, as compact codes[x - x0].
+  template <class Row>
+  static BasicGraph fromRows(const QSize& size, const QRect& roi, const Matrix<uint8_t>& mask, const Connectivity& connectivity,
+                             int threads, Precision precision, Row row);
+
+  // pixel of the image of grid node 'i', and the nodes of the pixels inside of the grid
+  int pixel(int i) const;
+  QVector<int> nodes(const QVector<int>& pixels) const;
+
+  int first(int i) const {
+    return connectivity_ ? i*connectivity_ : first_[i];
+  }
+
+  // -1 for grid slots falling outside of the image
+  int head(int a) const {
+    if (!connectivity_) return head_[a];
+    int i = a >> shift_, k = a & (connectivity_ - 1);
+    return links_[i] >> k & 1 ? i + offset_[k] : -1;
+  }
+
+  // paired reverse arc, grid slots without a head have none
+  int sister(int a) const {
+    if (!connectivity_) return sister_[a];
+    int k = a & (connectivity_ - 1);
+    return a - k + offset_[k]*connectivity_ + connectivity_ - 1 - k;
+  }
+
+  // the same with the connectivity known at compile time, 0 for a general graph,
+  // so that the neighbour loops of the engines unroll
+  template <int K> int first(int i) const {
+    return K ? i*K : first_[i];
+  }
+
+  template <int K> int head(int a) const {
+    if (!K) return head_[a];
+    int i = a / (K ? K : 1), k = a % (K ? K : 1);
+    return links_[i] >> k & 1 ? i + offset_[k] : -1;
+  }
+
+  template <int K> int sister(int a) const {
+    if (!K) return sister_[a];
+    int k = a % (K ? K : 1);
+    return a - k + offset_[k]*K + K - 1 - k;
+  }
+
+  // capacity given to arc 'a', negative if it was never added
+  flow_t weight(int a) const {
+    return connectivity_ ? gridWeight(a) : weight_[a];
+  }
 
-  QVector<QMap<int, flow_t>> edges_;
-  QVector<QMap<int, flow_t>> r_edges_;
+  // the same for a grid, whose compact weights are decoded from the planes
+  flow_t gridWeight(int a) const {
+    if (!decode_) return weight_[a];
+    int i = a >> shift_, k = a & (connectivity_ - 1), half = connectivity_ / 2;
+    if (!(links_[i] >> k & 1) || (links_[i] & Detached)) return -1;
+    if (k < half) {
+      i += offset_[k];
+      k = connectivity_ - 1 - k;
+    }
+    return decode_[codes_[size_t(k - half)*size_ + i]];
+  }
 
-  int bfs(int s, int t);
+  void setWeight(int a, float weight);
+  static quint16 encode(float weight);
+
+  void build();
+  void setTerminals(const QVector<int>& sources, const QVector<int>& sinks);
+  bool isActive(int i) const;
+  bool hasArc(int i, int a) const;
+  bool cancelled();
+
+  template <int K> int bfs(int s, int t);
   void dfs(int s);
 
+  // the engines dispatch on connectivity_ to their instantiations
+  void edmondsKarp();
+  template <int K> void edmondsKarp();
+
+  void boykovKolmogorov(bool reuse_trees = false);
+  template <int K> void boykovKolmogorov();
+  void initTrees();
+  void activate(int i);
+  int nextActive();
+  template <int K> int grow(int i);
+  template <int K> void augment(int a);
+  template <int K> void adopt(int i);
+
+  void changeCapacity(int a, flow_t from, flow_t to);
+  void shiftTerminal(int i, sum_t delta);
+  void updateTerminals(const QVector<int>& sources, const QVector<int>& sinks);
+  Side sideOf(int i) const;
+  void contract(int i, Side from, Side to, bool was_active, bool active);
+  void reseed(int i, Side to);
+  void repair(int i);
+  void orphan(int i);
+
+  struct Band;
+  void pushRelabel();
+  template <int K> void pushRelabel();
+  template <int K> void globalRelabel(WorkerPool& pool, std::atomic<bool>* claimed);
+  template <int K> void discharge(Band& band);
+  void enqueue(Band& band, int i);
+  void traverse(const cut_t& indices);
+
 public:
-  Graph(int size, const QSize& image_size);
+  BasicGraph() = default;
+  BasicGraph(int size, const QSize& image_size);
+
+  // Grid graph of the image, the rows are split between 'threads' threads,
+  // which are kept by the graph for the push-relabel engine. The neighbours
+  // are found from the coordinates, the arcs of an 8-connected grid take 66
+  // bytes per pixel with Precision::Single and 42 with Precision::Compact.
+  // The grid has at most maxPixels() nodes, larger images go to TiledCut.
+  // Compact weights are rounded to 0.1%, those below 1e-48 become 0. With a mask
+  // the grid covers regionOf(mask) only: nodeCount, addEdge and the cut count the
+  // nodes of the region, the seeds and the pixels returned are those of the image.
+  static BasicGraph fromImage(const QImage& image, const Matrix<uint8_t>& mask, const Connectivity& connectivity = Connectivity::Four,
+                         int threads = QThread::idealThreadCount(), Precision precision = Precision::Single);
+
+  // Largest grid fromImage and fromWeights build. Arcs are numbered with int, so an
+  // 8-connected grid has under 2^28 nodes (268 MP); the nodes are in QVectors of
+  // under 2 GB, which stops a 4-connected one at 536 MP, or at 268 MP for qint32.
+  static qint64 maxPixels(Connectivity connectivity);
 
-  static Graph fromImage(const QImage& image, const Matrix<uint8_t>& mask, const Connectivity& connectivity = Connectivity::Four);
+  // the same graph from the weights of an earlier NLinks, no n-link is evaluated again
+  static BasicGraph fromWeights(const NLinks& weights, const Matrix<uint8_t>& mask,
+                                int threads = QThread::idealThreadCount(), Precision precision = Precision::Single);
 
+  // Once the graph was solved by the BK engine, changing the mask, the capacities
+  // or the seeds keeps the flow: the next BK minCut only repairs the search trees
+  // around the changed nodes (dynamic graph cuts by Kohli and Torr). The mask is
+  // of the whole image, a grid over a region takes the part under the region.
   void setMask(const mask_t& mask);
 
+  // number of threads used by the push-relabel engine
+  void setThreadCount(int threads);
+  int threadCount() const;
+
+  // On a compact grid the capacity is set in both directions, a non-positive one
+  // becomes 0. Integer graphs scale the capacity by Traits::scale() and round it.
   void addEdge(int i, int j, float capacity);
 
-  cut_t minCut(const QVector<int>& sources, const QVector<int>& sinks);
+  bool isNull() const;
+  int nodeCount() const;
+  int arcCount() const;
+
+  // augmenting paths found by the last minCut, push-relabel doesn't look for paths
+  int augmentations() const;
+
+  // Called now and then by minCut with the augmentations and the flow so far,
+  // returning false stops the search: minCut returns an empty cut and the next
+  // one starts from scratch.
+  void setProgress(const progress_t& progress);
+  bool isInterrupted() const;
+
+  cut_t minCut(const QVector<int>& sources, const QVector<int>& sinks, Engine engine = Engine::EdmondsKarp);
+
+  // nodes left on the source side by the last minCut; getForeground also drops
+  // the nodes at the cut, which is fine for pixels but not for big regions
+  QVector<int> sourceSide() const;
 
   QVector<int> getForeground(const cut_t& indices);
   QVector<int> getBackground(const cut_t& indices);
+
+  // Pixels of a grid graph inside of its mask are set in 'mask' if they are in
+  // getForeground and cleared otherwise, in one traversal and without index
+  // vectors. The other pixels keep their bits.
+  void fillMask(const cut_t& indices, mask_t& mask);
 };
+
+using Graph = BasicGraph<float>;
@@ -1,51 +1,35 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include <QGraphicsEllipseItem>
+#include <QStatusBar>
 #include <QFileDialog>
 #include <QToolBar>
+#include <QSpinBox>
 #include <QPixmap>
 #include <QLabel>
 #include <QDebug>
 #include <QImage>
-#include <QStack>
-#include <QTime>
 
 #include "viewport.h"
-
-template<class T>
-void floodFill(Matrix<uint8_t>& src, int x, int y, T color, int connectivity = 4) {
-  static const int dx[] = {-1, 1, 0, 0, 1, -1, 1, 1 };
-  static const int dy[] = {0, 0, 1, -1, 1, 1, -1, -1};
-
-  QStack<QPoint> stack;
-  stack.push_back(QPoint(x, y));
-
-  T field_color = src(x, y);
-  src(x, y) = color;
-  do {
-    auto cur = stack.back();
-    stack.pop_back();
-
-    for (int i = 0; i < connectivity; ++i) {
-      QPoint tmp(cur.x() + dx[i], cur.y() + dy[i]);
-      if (tmp.x() < 0 || tmp.x() >= src.width()) continue;
-      if (tmp.y() < 0 || tmp.y() >= src.height()) continue;
-      if (src(tmp) == field_color) {
-        stack.push_back(tmp);
-        src(tmp) = color;
-      }
-    }
-  } while (!stack.isEmpty());
-}
+#include "trace.h"
 
 /* MainWindow */
 MainWindow::MainWindow(const QString& filename, QWidget* parent):
   QMainWindow(parent),
   ui_(new Ui::MainWindow),
-  viewport_(new Viewport(this))
+  viewport_(new Viewport(this)),
+  worker_(new SegmentationWorker())
 {
   ui_->setupUi(this);
 
+  qRegisterMetaType<SegmentationWorker::Job>();
+  qRegisterMetaType<SegmentationWorker::Result>();
+  worker_->moveToThread(&worker_thread_);
+  connect(&worker_thread_, SIGNAL(finished()), worker_, SLOT(deleteLater()));
+  connect(worker_, SIGNAL(progress(int, int, double)), this, SLOT(slotProgress(int, int, double)));
+  connect(worker_, SIGNAL(finished(SegmentationWorker::Result)), this, SLOT(slotFinished(SegmentationWorker::Result)));
+  worker_thread_.start();
+
   createToolbar();
   setCentralWidget(viewport_);
 
@@ -60,6 +44,9 @@ MainWindow::MainWindow(const QString& filename, QWidget* parent):
 }
 
 MainWindow::~MainWindow() {
+  worker_->supersede(++last_job_);
+  worker_thread_.quit();
+  worker_thread_.wait();
   delete ui_;
 }
 
@@ -68,11 +55,39 @@ void MainWindow::createToolbar() {
   ui_->mainToolBar->addSeparator();
   ui_->mainToolBar->addAction(QIcon("new.png"), "Clear", this, SLOT(slotClear()));
   ui_->mainToolBar->addAction(QIcon("run.png"), "Run", this, SLOT(slotRun()));
+  stop_action = ui_->mainToolBar->addAction("Stop", this, SLOT(slotStop()));
+  stop_action->setEnabled(false);
   ui_->mainToolBar->addSeparator();
 
   show_labels_action = ui_->mainToolBar->addAction(QIcon("draw-labels.png"), "Show Labels", this, SLOT(slotSetVisibleLabels()));
   show_labels_action->setCheckable(true);
   show_labels_action->setChecked(true);
+
+  // radius of the seed brush in pixels, 0 seeds single pixels
+  brush_box = new QSpinBox(this);
+  brush_box->setRange(0, 32);
+  brush_box->setValue(0);
+  brush_box->setToolTip("Brush radius");
+  ui_->mainToolBar->addWidget(brush_box);
+  ui_->mainToolBar->addSeparator();
+
+  // coarse-to-fine mode for large images, the band is in pixels of every level
+  pyramid_action = ui_->mainToolBar->addAction("Coarse-to-fine");
+  pyramid_action->setCheckable(true);
+  band_box = new QSpinBox(this);
+  band_box->setRange(1, 64);
+  band_box->setValue(4);
+  band_box->setToolTip("Band width");
+  ui_->mainToolBar->addWidget(band_box);
+
+  // cut over SLIC regions, the same band is then refined at full resolution
+  superpixels_action = ui_->mainToolBar->addAction("Superpixels");
+  superpixels_action->setCheckable(true);
+  ui_->mainToolBar->addSeparator();
+
+  // stages are recorded while checked and saved when unchecked
+  trace_action = ui_->mainToolBar->addAction("Trace", this, SLOT(slotTrace()));
+  trace_action->setCheckable(true);
 }
 
 void MainWindow::load(const QString& filename) {
@@ -80,120 +95,24 @@ void MainWindow::load(const QString& filename) {
   viewport_->setScene(source);
 
   image = image.convertToFormat(QImage::Format_RGB888);
+  canvas = QImage();
 
   viewport_->initial_marking = true;
-  viewport_->current_source.clear();
-  viewport_->current_sink.clear();
-  viewport_->source.clear();
-  viewport_->sink.clear();
+  viewport_->clearSeeds();
+  pending_source_.clear();
+  pending_sink_.clear();
+  cancel();
 }
 
-QImage MainWindow::applyMask() {
-  static const int dx[] = {-1, 0, 1, 0};
-  static const int dy[] = {0, 1, 0, -1};
-
-  auto canvas = image;
-  model = std::move(Matrix<uint8_t>(image.size(), 1));
-  for (int y = 0; y < mask.height(); ++y) {
-    for (int x = 0; x < mask.width(); ++x) {
-      if (!mask(x, y)) {
-        model(x, y) = 0;
-        auto pixel = canvas.pixel(x, y);
-        auto r = qRed(pixel) * 0.5 + 255 * 0.5;
-        auto g = qGreen(pixel) * 0.5 + 255 * 0.5;
-        auto b = qBlue(pixel) * 0.5 + 255 * 0.5;
-        canvas.setPixel(x, y, qRgb(r, g, b));
-      }
-    }
-  }
-
-  for (int x = 0; x < mask.width(); ++x) {
-    for (int y = 0; y < mask.height(); ++y) {
-      if (mask(x, y) == PixelClass::Foreground) {
-        auto pixel = canvas.pixel(x, y);
-        auto border = qRgb(qRed(pixel) * 0.25, qGreen(pixel) * 0.25, qBlue(pixel) * 0.25 + 255 * 0.75);
-
-        if (x == 0 || x == mask.width() - 1 || y == 0 || y == mask.height() - 1) {
-          canvas.setPixel(x, y, border);
-        }
-        else {
-          for (int i = 0; i < 4; ++i) {
-            if (mask(x + dx[i], y + dy[i]) == PixelClass::Background) {
-              canvas.setPixel(x + dx[i], y + dy[i], border);
-            }
-          }
-        }
-      }
-    }
-  }
-
-  // labels of regions
-  marked = model;
-  int counter = 2;
-  for (int x = 0; x < marked.width(); ++x) {
-    for (int y = 0; y < marked.height(); ++y) {
-      if (marked(x, y) < 2) {
-        floodFill(marked, x, y, counter++);
-      }
-    }
-  }
-
-  return canvas;
+// the results of the runs in progress are dropped, their seeds go to the next run
+void MainWindow::cancel() {
+  worker_->supersede(++last_job_);
+  stop_action->setEnabled(false);
+  statusBar()->clearMessage();
 }
 
-int MainWindow::intention(Matrix<uint8_t> model, const QVector<int>& source, const QVector<int>& sink) {
-  user_intention = std::move(Matrix<uint8_t>(image.size(), 1));
-
-  bool all_foreground = true;
-  bool all_background = true;
-
-  QVector<int> labels = source;
-  for (auto &vert : (labels << sink)) {
-    if (model(vert % image.width(), vert / image.width()) != PixelClass::Foreground) all_foreground = false;
-    if (model(vert % image.width(), vert / image.width()) != PixelClass::Background) all_background = false;
-  }
-
-  if (all_foreground) {
-    for (int x = 0; x < model.width(); ++x) {
-      for (int y = 0; y < model.height(); ++y) {
-        if (model(x, y) == PixelClass::Background) {
-          user_intention(x, y) = 0;
-        }
-      }
-    }
-
-    return UserAction::FB;
-  }
-  else if (all_background) {
-    for (int x = 0; x < model.width(); ++x) {
-      for (int y = 0; y < model.height(); ++y) {
-        if (model(x, y) == PixelClass::Foreground) {
-          user_intention(x, y) = 0;
-        }
-      }
-    }
-
-    return UserAction::BF;
-  }
-  else {
-    QSet<int> markers;
-    for (auto vert : source + sink) {
-      int mark = marked(vert % marked.width(), vert / marked.width());
-      markers.insert(mark);
-    }
-
-    for (int x = 0; x < model.width(); ++x) {
-      for (int y = 0; y < model.height(); ++y) {
-        if (!markers.contains(marked(x, y))) {
-          user_intention(x, y) = 0;
-        }
-      }
-    }
-
-    return UserAction::FBF_OR_BFB;
-  }
-
-  return 0;
+QImage MainWindow::applyMask() {
+  return SegmentationWorker::render(image, mask, model, marked);
 }
 
 void MainWindow::slotLoadFile() {
@@ -208,54 +127,88 @@ void MainWindow::slotLoadFile() {
 void MainWindow::slotClear() {
   viewport_->setScene(source);
   viewport_->initial_marking = true;
-  viewport_->current_source.clear();
-  viewport_->current_sink.clear();
-  viewport_->source.clear();
-  viewport_->sink.clear();
+  viewport_->clearSeeds();
+  pending_source_.clear();
+  pending_sink_.clear();
+  cancel();
 }
 
 void MainWindow::slotRun() {
-  int mode = 0;
   viewport_->sink << viewport_->current_sink;
   viewport_->source << viewport_->current_source;
-  if (!viewport_->initial_marking) {
-    mode = intention(model, viewport_->current_source, viewport_->current_sink);
-  }
-  else {
-    user_intention = std::move(Matrix<uint8_t>(image.size(), 1));
-    marked = std::move(Matrix<uint8_t>(image.size(), 0));
-    mask = std::move(Matrix<bool>(image.size(), true));
-  }
-
-  viewport_->initial_marking = false;
+  pending_sink_ << viewport_->current_sink;
+  pending_source_ << viewport_->current_source;
   viewport_->current_source.clear();
   viewport_->current_sink.clear();
 
-  Graph graph = Graph::fromImage(image, user_intention);
+  // a run still in progress is superseded by this one, which has all of its seeds
+  SegmentationWorker::Job job;
+  job.id = ++last_job_;
+  job.mode = superpixels_action->isChecked() ? SegmentationWorker::Mode::Superpixels :
+             pyramid_action->isChecked() ? SegmentationWorker::Mode::Pyramid : SegmentationWorker::Mode::Graph;
+  job.band = band_box->value();
+  job.initial = viewport_->initial_marking;
+  job.image = image;
+  job.canvas = canvas;
+  job.mask = mask;
+  job.model = model;
+  job.marked = marked;
+  job.source = viewport_->source;
+  job.sink = viewport_->sink;
+  job.current_source = pending_source_;
+  job.current_sink = pending_sink_;
+
+  worker_->supersede(job.id);
+  QMetaObject::invokeMethod(worker_, "run", Qt::QueuedConnection, Q_ARG(SegmentationWorker::Job, job));
+  stop_action->setEnabled(true);
+  statusBar()->showMessage("Running...");
+}
 
-  QTime timer;
-  timer.start();
-  auto cut = graph.minCut(viewport_->source, viewport_->sink);
-  qDebug() << "elapsed:" << timer.elapsed();
+void MainWindow::slotStop() {
+  cancel();
+}
 
-  for (auto vert : graph.getForeground(cut)) {
-    int x = vert % image.width();
-    int y = vert / image.width();
-    mask(x, y) = 1;
-  }
-  for (auto vert : graph.getBackground(cut)) {
-    int x = vert % image.width();
-    int y = vert / image.width();
-    mask(x, y) = 0;
+void MainWindow::slotProgress(int id, int augmentations, double flow) {
+  if (id != last_job_) return;
+  statusBar()->showMessage(QString("Running: %1 paths, flow %2").arg(augmentations).arg(flow));
+}
+
+void MainWindow::slotFinished(const SegmentationWorker::Result& result) {
+  if (result.id != last_job_) return;
+
+  stop_action->setEnabled(false);
+  statusBar()->clearMessage();
+  if (result.cancelled) return;
+
+  viewport_->initial_marking = false;
+  pending_source_.clear();
+  pending_sink_.clear();
+  user_intention = result.user_intention;
+  mask = result.mask;
+  model = result.model;
+  marked = result.marked;
+  canvas = result.canvas;
+
+  Trace::Scope scope("window.scene");
+  viewport_->updatePixmap(canvas, result.dirty);
+}
+
+void MainWindow::slotTrace() {
+  if (trace_action->isChecked()) {
+    Trace::clear();
+    Trace::setEnabled(true);
+    return;
   }
 
-  viewport_->setScene(applyMask());
-  viewport_->redrawNotes();
+  Trace::setEnabled(false);
+  auto title = "Save trace";
+  auto filters = "Chrome trace (*.json);;CSV summary (*.csv)";
+  auto filename = QFileDialog::getSaveFileName(this, title, "", filters);
+  if (!filename.isEmpty() && !Trace::save(filename)) {
+    statusBar()->showMessage("Can't write " + filename);
+  }
 }
 
 void MainWindow::slotSetVisibleLabels() {
-  viewport_->setScene(viewport_->pixmap);
-  if (show_labels_action->isChecked()) {
-    viewport_->redrawNotes();
-  }
+  viewport_->redrawNotes();
 }
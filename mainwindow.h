@@ -2,12 +2,15 @@
 #define MAINWINDOW_H_INCLUDED__
 
 #include <QMainWindow>
+#include <QThread>
 #include <stdint.h>
 
 #include "graph.h"
 #include "matrix.h"
+#include "worker.h"
 
 class Viewport;
+class QSpinBox;
 
 namespace Ui {
   class MainWindow;
@@ -31,31 +34,47 @@ public:
 public:
   QImage source;
   QImage image;
+  QImage canvas; // image with the mask, as shown
   Matrix<bool> mask;
   Matrix<uint8_t> model;
-  Matrix<uint8_t> marked;
+  Components marked;
   Matrix<uint8_t> user_intention;
   QAction* show_labels_action;
+  QAction* pyramid_action;
+  QAction* superpixels_action;
+  QAction* stop_action;
+  QAction* trace_action;
+  QSpinBox* band_box;
+  QSpinBox* brush_box;
 
   MainWindow(const QString& filename, QWidget* parent = nullptr);
   ~MainWindow();
 
+  // renders 'mask' over the image and labels its regions
+  QImage applyMask();
+
 private:
   Ui::MainWindow* ui_;
   Viewport* viewport_;
+  QThread worker_thread_;
+  SegmentationWorker* worker_;
+  int last_job_ = 0;
+  QVector<int> pending_source_, pending_sink_; // seeds of runs not shown yet
 
   void createToolbar();
 
   void load(const QString& filename);
-
-  QImage applyMask();
-  int intention(Matrix<uint8_t> model, const QVector<int>& source, const QVector<int>& sink);
+  void cancel();
 
 public slots:
   void slotLoadFile();
   void slotClear();
   void slotRun();
+  void slotStop();
+  void slotProgress(int id, int augmentations, double flow);
+  void slotFinished(const SegmentationWorker::Result& result);
   void slotSetVisibleLabels();
+  void slotTrace();
 };
 
 #endif // MAINWINDOW_H_INCLUDED__
@@ -1,38 +1,120 @@
 #pragma once
+#include <QtGlobal>
+#include <QtAlgorithms>
 #include <QSize>
 #include <QPoint>
-#include <functional>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+#endif
+
+namespace matrix_kernels {
+
+// Row kernels. Four partial results instead of one accumulator break the
+// dependency between iterations, so the loops vectorize or at least pipeline.
+template<typename A, typename T>
+A sum(const T* src, int n) {
+  A part[4] = {A(0), A(0), A(0), A(0)};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    part[0] += src[i];
+    part[1] += src[i + 1];
+    part[2] += src[i + 2];
+    part[3] += src[i + 3];
+  }
+  for (; i < n; ++i) {
+    part[0] += src[i];
+  }
+
+  return (part[0] + part[1]) + (part[2] + part[3]);
+}
+
+template<typename T, typename Compare>
+T extremum(const T* src, int n, T acc, Compare better) {
+  T part[4] = {acc, acc, acc, acc};
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    part[0] = better(src[i], part[0]) ? src[i] : part[0];
+    part[1] = better(src[i + 1], part[1]) ? src[i + 1] : part[1];
+    part[2] = better(src[i + 2], part[2]) ? src[i + 2] : part[2];
+    part[3] = better(src[i + 3], part[3]) ? src[i + 3] : part[3];
+  }
+  for (; i < n; ++i) {
+    part[0] = better(src[i], part[0]) ? src[i] : part[0];
+  }
+
+  for (int k = 1; k < 4; ++k) {
+    if (better(part[k], part[0])) part[0] = part[k];
+  }
+  return part[0];
+}
+
+}
 
 template<typename T>
 class Matrix
 {
+  // Rows start on a cache line: row loops get aligned loads and
+  // rows written by different threads don't share a line.
+  static const int alignment = 64;
+
   T* data_ = nullptr;
   int width_ = 0, height_ = 0;
+  int stride_ = 0; // elements between the starts of two rows
+
+  static int strideOf(int width) {
+    if (alignment % sizeof(T)) return width;
+
+    const int step = alignment / sizeof(T);
+    return (width + step - 1) / step*step;
+  }
+
+  size_t bytes() const {
+    return sizeof(T)*size_t(stride_)*height_;
+  }
+
+  void allocate(int width, int height) {
+    width_ = width;
+    height_ = height;
+    stride_ = strideOf(width);
+    if (bytes()) {
+      data_ = static_cast<T*>(qMallocAligned(bytes(), alignment));
+      memset(data_, 0, bytes()); // padding too, copies of it stay defined
+    }
+  }
 
   void release() {
     if (data_) {
-      delete[] data_;
+      qFreeAligned(data_);
       data_ = nullptr;
     }
 
-    width_ = height_ = 0;
+    width_ = height_ = stride_ = 0;
   }
 
+  template<typename S> friend class Matrix;
+
 public:
   Matrix() = default;
 
-  Matrix(const Matrix<T>& other) :
-    data_(new T[other.width_*other.height_]),
-    width_(other.width_),
-    height_(other.height_) {
-    memcpy(data_, other.data_, sizeof(T)*width_*height_);
+  Matrix(const Matrix<T>& other) {
+    allocate(other.width_, other.height_);
+    if (data_) memcpy(data_, other.data_, bytes());
   }
 
   Matrix(Matrix<T>&& other) :
     data_(other.data_),
     width_(other.width_),
-    height_(other.height_) {
+    height_(other.height_),
+    stride_(other.stride_) {
     other.data_ = nullptr;
+    other.width_ = other.height_ = other.stride_ = 0;
   }
 
   Matrix(const QSize& size, const T& val = 0) {
@@ -44,22 +126,14 @@ public:
   }
 
   ~Matrix() {
-    if (data_) {
-      delete[] data_;
-    }
+    release();
   }
 
   Matrix<T>& operator = (const Matrix<T>& rhs) {
     if (this == &rhs) return *this;
 
-    if (width_*height_ != rhs.width_*rhs.height_) {
-      release();
-      width_ = rhs.width_;
-      height_ = rhs.height_;
-      data_ = new T[width_*height_];
-    }
-
-    memcpy(data_, rhs.data_, sizeof(T)*width_*height_);
+    recreate(rhs.width_, rhs.height_);
+    if (data_) memcpy(data_, rhs.data_, bytes());
     return *this;
   }
 
@@ -67,18 +141,21 @@ public:
     if (this == &rhs) return *this;
 
     release();
-    width_ = rhs.width_;
-    height_ = rhs.height_;
-    std::swap(data_, rhs.data_);
+    swap(rhs);
 
     return *this;
   }
 
-  static Matrix<T> unite(const Matrix<T>& lhs, const Matrix<T>& rhs, std::function<T(T, T)> unite_func) {
-    Matrix<T> dst(lhs.size());
-    for (int i = 0; i < lhs.width(); ++i) {
-      for (int j = 0; j < lhs.height(); ++j) {
-        dst(i, j) = unite_func(lhs(i, j), rhs(i, j));
+  template<typename Func>
+  static Matrix<T> unite(const Matrix<T>& lhs, const Matrix<T>& rhs, Func unite_func) {
+    Matrix<T> dst;
+    dst.allocate(lhs.width(), lhs.height());
+    for (int j = 0; j < lhs.height(); ++j) {
+      const T* l = lhs.line(j);
+      const T* r = rhs.line(j);
+      T* d = dst.line(j);
+      for (int i = 0; i < lhs.width(); ++i) {
+        d[i] = unite_func(l[i], r[i]);
       }
     }
 
@@ -87,30 +164,25 @@ public:
 
   template<typename S>
   Matrix<T>& from(const Matrix<S>& src) {
-    if (data_) delete[] data_;
-
-    data_ = new T[src.width() * src.height()];
-    width_ = src.width();
-    height_ = src.height();
-
-    for (int i = 0; i < width_; ++i) {
-      for (int j = 0; j < height_; ++j) {
-        at(i, j) = static_cast<T>(src(i, j));
+    recreate(src.width(), src.height());
+    for (int j = 0; j < height_; ++j) {
+      const S* s = src.line(j);
+      T* d = line(j);
+      for (int i = 0; i < width_; ++i) {
+        d[i] = static_cast<T>(s[i]);
       }
     }
 
     return *this;
   }
 
+  // masks are unpacked by the mask itself
+  Matrix<T>& from(const Matrix<bool>& src);
+
   template<typename S>
   Matrix<S> to() const {
-    Matrix<S> dst(size());
-    for (int i = 0; i < width_; ++i) {
-      for (int j = 0; j < height_; ++j) {
-        dst(i, j) = static_cast<S>((*this)(i, j));
-      }
-    }
-
+    Matrix<S> dst;
+    dst.from(*this);
     return dst;
   }
 
@@ -120,21 +192,20 @@ public:
   }
 
   void recreate(int width, int height) {
-    if (width_ * height_ != width * height) {
+    if (width != width_ || height != height_) {
       release();
-      data_ = new T[width * height];
+      allocate(width, height);
     }
-
-    width_ = width;
-    height_ = height;
   }
 
   void swap(Matrix<T>& matrix) {
     std::swap(data_, matrix.data_);
     std::swap(width_, matrix.width_);
     std::swap(height_, matrix.height_);
+    std::swap(stride_, matrix.stride_);
   }
 
+  // rows are stride() elements apart
   T* data() const {
     return data_;
   }
@@ -155,6 +226,10 @@ public:
     return width_;
   }
 
+  int stride() const {
+    return stride_;
+  }
+
   bool isCorrect(const QPoint& point) const {
     return isCorrect(point.x(), point.y());
   }
@@ -164,50 +239,49 @@ public:
   }
 
   T& operator () (const QPoint& point) {
-    return data_[point.x() + point.y()*width_];
+    return data_[point.x() + point.y()*stride_];
   }
 
   const T operator () (const QPoint& point) const {
-    return data_[point.x() + point.y()*width_];
+    return data_[point.x() + point.y()*stride_];
   }
 
   T& operator () (int i, int j) {
-    return data_[i + j*width_];
+    return data_[i + j*stride_];
   }
 
   const T operator () (int i, int j) const {
-    return data_[i + j*width_];
+    return data_[i + j*stride_];
   }
 
   T& at(const QPoint& point) {
-    return data_[point.x + point.y*width_];
+    return data_[point.x() + point.y()*stride_];
   }
 
   const T at(const QPoint& point) const {
-    return data_[point.x() + point.y()*width_];
+    return data_[point.x() + point.y()*stride_];
   }
 
   T& at(int i, int j) {
-    return data_[i + j*width_];
+    return data_[i + j*stride_];
   }
 
   const T at(int i, int j) const {
-    return data_[i + j*width_];
+    return data_[i + j*stride_];
   }
 
   T* line(int j) {
-    return data_ + j*width_;
+    return data_ + j*stride_;
   }
 
   const T* line(int j) const {
-    return data_ + j*width_;
+    return data_ + j*stride_;
   }
 
   T sum() const {
     T acc = 0;
-    T* cur = data_;
-    for (int i = 0, n = width_*height_; i < n; ++i) {
-      acc += *cur++;
+    for (int j = 0; j < height_; ++j) {
+      acc += matrix_kernels::sum<T>(line(j), width_);
     }
 
     return acc;
@@ -215,57 +289,49 @@ public:
 
   T medium() const {
     double acc = 0;
-    T* cur = data_;
-    for (int i = 0, n = width_*height_; i < n; ++i) {
-      acc += *cur++;
+    for (int j = 0; j < height_; ++j) {
+      acc += matrix_kernels::sum<double>(line(j), width_);
     }
 
     return T(acc / (width_*height_));
   }
 
   T maximum() const {
-    T* cur = data_;
-    T fmax = *cur++;
-    for (int i = 1, n = width_*height_; i < n; ++i) {
-      if (*cur > fmax) fmax = *cur;
-      ++cur;
+    T fmax = *data_;
+    for (int j = 0; j < height_; ++j) {
+      fmax = matrix_kernels::extremum(line(j), width_, fmax, [](T a, T b) { return a > b; });
     }
 
     return fmax;
   }
 
   T minimum() const {
-    T* cur = data_;
-    T fmin = *cur++;
-    for (int i = 1, n = width_*height_; i < n; ++i) {
-      if (*cur < fmin) fmin = *cur;
-      ++cur;
+    T fmin = *data_;
+    for (int j = 0; j < height_; ++j) {
+      fmin = matrix_kernels::extremum(line(j), width_, fmin, [](T a, T b) { return a < b; });
     }
 
     return fmin;
   }
 
-  Matrix<T>& transform(std::function<T(T)> func) {
-    T* cur = data_;
-    int n = width_*height_;
-    for (int i = 0; i < n; ++i) {
-      *cur = func(*cur);
-      ++cur;
+  template<typename Func>
+  Matrix<T>& transform(Func func) {
+    for (int j = 0; j < height_; ++j) {
+      T* cur = line(j);
+      for (int i = 0; i < width_; ++i) {
+        cur[i] = func(cur[i]);
+      }
     }
 
     return *this;
   }
 
   Matrix<T>& scale(T down, T up) {
-    T* cur = data_;
     T fmin = minimum();
     double temp = double(up - down) / (maximum() - fmin);
-    for (int i = 0, n = width_*height_; i < n; ++i) {
-      *cur = T(down + (*cur - fmin) * temp);
-      ++cur;
-    }
-
-    return *this;
+    return transform([=](T val) {
+      return T(down + (val - fmin) * temp);
+    });
   }
 
   Matrix<T> scaled(T down, T up) const {
@@ -274,31 +340,435 @@ public:
   }
 
   Matrix<T>& transpose() {
-    T* dst = new T[height_*width_];
-    for (int i = 0; i < width_; ++i) {
-      for (int j = 0; j < height_; ++j) {
-        dst[i + j*width_] = data_[j + i*width_];
+    // square blocks keep both the rows read and the rows written in cache
+    static const int block = 32;
+
+    Matrix<T> dst;
+    dst.allocate(height_, width_);
+    for (int j0 = 0; j0 < height_; j0 += block) {
+      for (int i0 = 0; i0 < width_; i0 += block) {
+        for (int i = i0, i1 = std::min(i0 + block, width_); i < i1; ++i) {
+          T* d = dst.line(i);
+          for (int j = j0, j1 = std::min(j0 + block, height_); j < j1; ++j) {
+            d[j] = data_[i + j*stride_];
+          }
+        }
       }
     }
 
-    delete[] data_;
-    data_ = dst;
-
-    std::swap(height_, width_);
+    swap(dst);
     return *this;
   }
 
   Matrix<T>& clear(const T& val) {
-    T* cur = data_;
-    int n = width_*height_;
-    for (int i = 0; i < n; ++i) {
-      *cur++ = val;
+    for (int j = 0; j < height_; ++j) {
+      std::fill(line(j), line(j) + width_, val);
     }
 
     return *this;
   }
 };
 
+// Index of the lowest set bit of a non-zero word. qCountTrailingZeroBits
+// needs Qt 5.6.
+inline int trailingZeros(quint64 word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_WIN64)
+  unsigned long i;
+  _BitScanForward64(&i, word);
+  return int(i);
+#else
+  int i = 0;
+  for (; !(word & 0xffffffff); word >>= 32) i += 32;
+  for (; !(word & 1); word >>= 1) ++i;
+  return i;
+#endif
+}
+
+// Masks, 64 pixels to a word. Bits past the width in the last word of a row
+// stay zero, so whole words can be combined and counted.
+template<>
+class Matrix<bool>
+{
+public:
+  using word_t = quint64;
+
+  // reference to a single pixel
+  class Bit {
+    word_t* word_;
+    word_t bit_;
+
+  public:
+    Bit(word_t* word, int i) : word_(word), bit_(word_t(1) << i) {}
+    Bit(const Bit&) = default;
+
+    Bit& operator = (bool val) {
+      if (val) *word_ |= bit_;
+      else *word_ &= ~bit_;
+      return *this;
+    }
+
+    Bit& operator = (const Bit& other) {
+      return *this = bool(other);
+    }
+
+    operator bool() const {
+      return (*word_ & bit_) != 0;
+    }
+  };
+
+private:
+  static const int alignment = 64;
+
+  word_t* data_ = nullptr;
+  int width_ = 0, height_ = 0;
+  int words_ = 0; // words in a row
+
+  size_t bytes() const {
+    return sizeof(word_t)*size_t(words_)*height_;
+  }
+
+  void allocate(int width, int height) {
+    width_ = width;
+    height_ = height;
+    words_ = (width + 63) / 64;
+    if (bytes()) {
+      data_ = static_cast<word_t*>(qMallocAligned(bytes(), alignment));
+      memset(data_, 0, bytes());
+    }
+  }
+
+  void release() {
+    if (data_) {
+      qFreeAligned(data_);
+      data_ = nullptr;
+    }
+
+    width_ = height_ = words_ = 0;
+  }
+
+  // bits of the last word of a row which are pixels
+  word_t tail() const {
+    return width_ % 64 ? (word_t(1) << (width_ % 64)) - 1 : ~word_t(0);
+  }
+
+  template<typename Func>
+  Matrix<bool>& combine(const Matrix<bool>& rhs, Func func) {
+    for (size_t i = 0, n = size_t(words_)*height_; i < n; ++i) {
+      data_[i] = func(data_[i], rhs.data_[i]);
+    }
+
+    return *this;
+  }
+
+public:
+  Matrix() = default;
+
+  Matrix(const Matrix<bool>& other) {
+    allocate(other.width_, other.height_);
+    if (data_) memcpy(data_, other.data_, bytes());
+  }
+
+  Matrix(Matrix<bool>&& other) :
+    data_(other.data_),
+    width_(other.width_),
+    height_(other.height_),
+    words_(other.words_) {
+    other.data_ = nullptr;
+    other.width_ = other.height_ = other.words_ = 0;
+  }
+
+  Matrix(const QSize& size, bool val = false) {
+    recreate(size.width(), size.height(), val);
+  }
+
+  Matrix(int width, int height, bool val = false) {
+    recreate(width, height, val);
+  }
+
+  ~Matrix() {
+    release();
+  }
+
+  Matrix<bool>& operator = (const Matrix<bool>& rhs) {
+    if (this == &rhs) return *this;
+
+    recreate(rhs.width_, rhs.height_);
+    if (data_) memcpy(data_, rhs.data_, bytes());
+    return *this;
+  }
+
+  Matrix<bool>& operator = (Matrix<bool>&& rhs) {
+    if (this == &rhs) return *this;
+
+    release();
+    swap(rhs);
+
+    return *this;
+  }
+
+  // any non-zero value is set
+  template<typename S>
+  Matrix<bool>& from(const Matrix<S>& src) {
+    recreate(src.width(), src.height());
+    for (int j = 0; j < height_; ++j) {
+      pack(src.line(j), line(j));
+    }
+
+    return *this;
+  }
+
+  template<typename S>
+  Matrix<S> to() const {
+    Matrix<S> dst(size());
+    for (int j = 0; j < height_; ++j) {
+      const word_t* src = line(j);
+      S* d = dst.line(j);
+      for (int i = 0; i < width_; ++i) {
+        d[i] = static_cast<S>((src[i >> 6] >> (i & 63)) & 1);
+      }
+    }
+
+    return dst;
+  }
+
+  void recreate(int width, int height, bool val) {
+    recreate(width, height);
+    clear(val);
+  }
+
+  void recreate(int width, int height) {
+    if (width != width_ || height != height_) {
+      release();
+      allocate(width, height);
+    }
+  }
+
+  void swap(Matrix<bool>& matrix) {
+    std::swap(data_, matrix.data_);
+    std::swap(width_, matrix.width_);
+    std::swap(height_, matrix.height_);
+    std::swap(words_, matrix.words_);
+  }
+
+  // rows are wordsPerLine() words apart
+  word_t* data() const {
+    return data_;
+  }
+
+  int wordsPerLine() const {
+    return words_;
+  }
+
+  bool isNull() const {
+    return !data_ || !width_ || !height_;
+  }
+
+  QSize size() const {
+    return QSize(width_, height_);
+  }
+
+  int height() const {
+    return height_;
+  }
+
+  int width() const {
+    return width_;
+  }
+
+  bool isCorrect(const QPoint& point) const {
+    return isCorrect(point.x(), point.y());
+  }
+
+  bool isCorrect(int x, int y) const {
+    return (x >= 0 && y >= 0 && x < width_ && y < height_);
+  }
+
+  Bit operator () (const QPoint& point) {
+    return at(point.x(), point.y());
+  }
+
+  bool operator () (const QPoint& point) const {
+    return at(point.x(), point.y());
+  }
+
+  Bit operator () (int i, int j) {
+    return at(i, j);
+  }
+
+  bool operator () (int i, int j) const {
+    return at(i, j);
+  }
+
+  Bit at(const QPoint& point) {
+    return at(point.x(), point.y());
+  }
+
+  bool at(const QPoint& point) const {
+    return at(point.x(), point.y());
+  }
+
+  Bit at(int i, int j) {
+    return Bit(data_ + j*words_ + (i >> 6), i & 63);
+  }
+
+  bool at(int i, int j) const {
+    return (data_[j*words_ + (i >> 6)] >> (i & 63)) & 1;
+  }
+
+  word_t* line(int j) {
+    return data_ + j*words_;
+  }
+
+  const word_t* line(int j) const {
+    return data_ + j*words_;
+  }
+
+  // number of set pixels
+  qint64 count() const {
+    qint64 acc = 0;
+    for (size_t i = 0, n = size_t(words_)*height_; i < n; ++i) {
+      acc += qPopulationCount(data_[i]);
+    }
+
+    return acc;
+  }
+
+  Matrix<bool>& clear(bool val) {
+    if (!data_) return *this;
+
+    for (int j = 0; j < height_; ++j) {
+      word_t* cur = line(j);
+      std::fill(cur, cur + words_, val ? ~word_t(0) : word_t(0));
+      cur[words_ - 1] &= tail();
+    }
+
+    return *this;
+  }
+
+  Matrix<bool>& operator &= (const Matrix<bool>& rhs) {
+    return combine(rhs, [](word_t a, word_t b) { return a & b; });
+  }
+
+  Matrix<bool>& operator |= (const Matrix<bool>& rhs) {
+    return combine(rhs, [](word_t a, word_t b) { return a | b; });
+  }
+
+  Matrix<bool>& operator ^= (const Matrix<bool>& rhs) {
+    return combine(rhs, [](word_t a, word_t b) { return a ^ b; });
+  }
+
+  // in place NOT
+  Matrix<bool>& invert() {
+    for (int j = 0; j < height_; ++j) {
+      word_t* cur = line(j);
+      for (int i = 0; i < words_; ++i) {
+        cur[i] = ~cur[i];
+      }
+      cur[words_ - 1] &= tail();
+    }
+
+    return *this;
+  }
+
+  Matrix<bool> operator ~ () const {
+    return Matrix<bool>(*this).invert();
+  }
+
+  Matrix<bool> operator & (const Matrix<bool>& rhs) const {
+    return Matrix<bool>(*this) &= rhs;
+  }
+
+  Matrix<bool> operator | (const Matrix<bool>& rhs) const {
+    return Matrix<bool>(*this) |= rhs;
+  }
+
+  Matrix<bool> operator ^ (const Matrix<bool>& rhs) const {
+    return Matrix<bool>(*this) ^= rhs;
+  }
+
+  // Pixel (x, y) of the result is pixel (x - dx, y - dy) of this one,
+  // for steps of at most one pixel; pixels shifted in are not set.
+  Matrix<bool> shifted(int dx, int dy) const {
+    Q_ASSERT(qAbs(dx) <= 1 && qAbs(dy) <= 1);
+
+    Matrix<bool> dst;
+    dst.allocate(width_, height_);
+    for (int j = qMax(0, dy); j < qMin(height_, height_ + dy); ++j) {
+      const word_t* src = line(j - dy);
+      word_t* d = dst.line(j);
+      if (dx > 0) {
+        for (int i = 0; i < words_; ++i) {
+          d[i] = (src[i] << 1) | (i ? src[i - 1] >> 63 : 0);
+        }
+        d[words_ - 1] &= tail();
+      }
+      else if (dx < 0) {
+        for (int i = 0; i < words_; ++i) {
+          d[i] = (src[i] >> 1) | (i + 1 < words_ ? src[i + 1] << 63 : 0);
+        }
+      }
+      else {
+        memcpy(d, src, sizeof(word_t)*words_);
+      }
+    }
+
+    return dst;
+  }
+
+  // set pixels with a 4-neighbour that is not set, or on the edge of the image
+  Matrix<bool> border() const {
+    Matrix<bool> inner = shifted(1, 0);
+    inner &= shifted(-1, 0);
+    inner &= shifted(0, 1);
+    inner &= shifted(0, -1);
+    return *this & ~inner;
+  }
+
+private:
+  template<typename S>
+  void pack(const S* src, word_t* dst) const {
+    for (int w = 0; w < words_; ++w) {
+      word_t bits = 0;
+      for (int i = w*64, k = 0; i < qMin(width_, w*64 + 64); ++i, ++k) {
+        bits |= word_t(src[i] != 0) << k;
+      }
+      dst[w] = bits;
+    }
+  }
+
+#ifdef __SSE2__
+  // byte masks are packed 16 pixels at a time
+  void pack(const uint8_t* src, word_t* dst) const {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 64 <= width_; i += 64) {
+      word_t bits = 0;
+      for (int k = 0; k < 4; ++k) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16*k));
+        word_t zeros = word_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        bits |= (~zeros & 0xffff) << (16*k);
+      }
+      dst[i >> 6] = bits;
+    }
+
+    if (i < width_) {
+      word_t bits = 0;
+      for (int k = 0; i + k < width_; ++k) {
+        bits |= word_t(src[i + k] != 0) << k;
+      }
+      dst[i >> 6] = bits;
+    }
+  }
+#endif
+};
+
+template<typename T>
+Matrix<T>& Matrix<T>::from(const Matrix<bool>& src) {
+  return *this = src.to<T>();
+}
+
 using matd = Matrix<double>;
 using matb = Matrix<bool>;
 using mati = Matrix<int>;
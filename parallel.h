@@ -0,0 +1,123 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Calls func(i) for every i in [0, count) on up to 'threads' threads,
+// handing out indices one at a time. Returns when all calls are done.
+template<typename Func>
+void parallelFor(int count, int threads, Func func) {
+  if (threads > count) threads = count;
+  if (threads <= 1) {
+    for (int i = 0; i < count; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      func(i);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; ++t) {
+    pool.emplace_back(worker);
+  }
+  worker();
+
+  for (auto& thread : pool) {
+    thread.join();
+  }
+}
+
+// Threads kept for a series of parallel steps, so a step doesn't pay for
+// starting them. run() hands out the indices like parallelFor and returns
+// when all calls are done; the threads sleep between the runs.
+class WorkerPool {
+public:
+  explicit WorkerPool(int threads) {
+    for (int t = 1; t < threads; ++t) {
+      pool_.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : pool_) {
+      thread.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  int size() const {
+    return int(pool_.size()) + 1;
+  }
+
+  template<typename Func>
+  void run(int count, Func func) {
+    if (pool_.empty() || count <= 1) {
+      for (int i = 0; i < count; ++i) {
+        func(i);
+      }
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = func;
+      count_ = count;
+      next_ = 0;
+      busy_ = int(pool_.size());
+      ++generation_;
+    }
+    wake_.notify_all();
+    take();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return busy_ == 0; });
+    job_ = nullptr;
+  }
+
+private:
+  std::vector<std::thread> pool_;
+  std::mutex mutex_;
+  std::condition_variable wake_, done_;
+  std::function<void(int)> job_;
+  std::atomic<int> next_{0};
+  int count_ = 0, busy_ = 0;
+  unsigned generation_ = 0;
+  bool stop_ = false;
+
+  void take() {
+    for (int i = next_++; i < count_; i = next_++) {
+      job_(i);
+    }
+  }
+
+  void work() {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+      if (stop_) return;
+      seen = generation_;
+
+      lock.unlock();
+      take();
+      lock.lock();
+      if (--busy_ == 0) done_.notify_one();
+    }
+  }
+};
@@ -0,0 +1,269 @@
+#include "graph.h"
+#include "parallel.h"
+#include "trace.h"
+#include <memory>
+
+using namespace std;
+
+// Rows of a grid graph discharged by one thread. Bands of the same parity
+// run concurrently; they are at least two rows high and never adjacent, so
+// a band only touches nodes of its own rows and of the idle bands around it.
+template <class Cap>
+struct BasicGraph<Cap>::Band {
+  int first, last;
+  QVector<int> queue;
+  int work;
+};
+
+template <class Cap>
+void BasicGraph<Cap>::setThreadCount(int threads) {
+  threads_ = qMax(1, threads);
+}
+
+template <class Cap>
+int BasicGraph<Cap>::threadCount() const {
+  return threads_;
+}
+
+// Exact distances to the sink by a backward BFS over residual arcs,
+// nodes which can't reach the sink get the label size_. With several threads
+// the BFS goes a level at a time, large levels are split between the threads
+// of 'pool' and a node is labelled by the thread that claims it first.
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::globalRelabel(WorkerPool& pool, std::atomic<bool>* claimed) {
+  Trace::Scope scope("graph.globalRelabel");
+  if (pool.size() == 1) {
+    label_.fill(size_);
+
+    int begin = 0, end = 0;
+    for (int i = 0; i < size_; ++i) {
+      if (sink_cap_[i] > Traits::epsilon()) {
+        label_[i] = 1;
+        queue_[end++] = i;
+      }
+    }
+
+    while (begin != end) {
+      int u = queue_[begin++];
+      for (int a = first<K>(u); a < first<K>(u + 1); ++a) {
+        int v = head<K>(a);
+        if (v >= 0 && label_[v] == size_ && cap_[sister<K>(a)] > Traits::epsilon()) {
+          label_[v] = label_[u] + 1;
+          queue_[end++] = v;
+        }
+      }
+    }
+    return;
+  }
+
+  // levels smaller than this aren't worth waking the threads
+  static const int min_level = 4096;
+  int parts = 4*pool.size();
+  QVector<QVector<int>> found(parts);
+
+  pool.run(parts, [&](int p) {
+    found[p].clear();
+    for (int i = qint64(size_)*p / parts, end = qint64(size_)*(p + 1) / parts; i < end; ++i) {
+      bool next_to_sink = sink_cap_[i] > Traits::epsilon();
+      label_[i] = next_to_sink ? 1 : size_;
+      claimed[i].store(next_to_sink, std::memory_order_relaxed);
+      if (next_to_sink) found[p] << i;
+    }
+  });
+
+  QVector<int> level;
+  for (auto& nodes : found) level += nodes;
+
+  for (int label = 2; !level.isEmpty(); ++label) {
+    int count = level.size() >= min_level ? parts : 1;
+    pool.run(count, [&](int p) {
+      QVector<int>& next = found[p];
+      next.clear();
+      for (int k = qint64(level.size())*p / count, end = qint64(level.size())*(p + 1) / count; k < end; ++k) {
+        int u = level[k];
+        for (int a = first<K>(u); a < first<K>(u + 1); ++a) {
+          int v = head<K>(a);
+          if (v < 0 || cap_[sister<K>(a)] <= Traits::epsilon()) continue;
+          if (claimed[v].load(std::memory_order_relaxed)) continue;
+          // a level walked by one thread needs no atomic exchange
+          if (count == 1) claimed[v].store(true, std::memory_order_relaxed);
+          else if (claimed[v].exchange(true, std::memory_order_relaxed)) continue;
+          label_[v] = label;
+          next << v;
+        }
+      }
+    });
+
+    level.clear();
+    if (count == 1) level.swap(found[0]);
+    else for (int p = 0; p < count; ++p) level += found[p];
+  }
+}
+
+template <class Cap>
+void BasicGraph<Cap>::enqueue(Band& band, int i) {
+  if (active_[i] || label_[i] >= size_ || excess_[i] <= Traits::epsilon()) return;
+
+  active_[i] = true;
+  band.queue << i;
+}
+
+// FIFO push-relabel over the active nodes of a band. Excess pushed out of the
+// band is picked up by the neighbouring band on its next turn. Stops early
+// once the band has done enough relabelling to make a global relabel worth it.
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::discharge(Band& band) {
+  int budget = 6*(band.last - band.first) + 1, work = 0;
+  int pos = 0;
+
+  while (pos < band.queue.size() && work < budget) {
+    int u = band.queue[pos++];
+    active_[u] = false;
+
+    while (excess_[u] > Traits::epsilon() && label_[u] < size_) {
+      if (sink_cap_[u] > Traits::epsilon()) {
+        sum_t delta = qMin(excess_[u], sink_cap_[u]);
+        sink_cap_[u] -= delta;
+        excess_[u] -= delta;
+        terminals_[u] |= SinkFlow;
+        if (excess_[u] <= Traits::epsilon()) break;
+      }
+
+      int lowest = size_;
+      for (int a = first<K>(u); a < first<K>(u + 1) && excess_[u] > Traits::epsilon(); ++a) {
+        int v = head<K>(a);
+        if (v < 0 || cap_[a] <= Traits::epsilon()) continue;
+
+        if (label_[u] == label_[v] + 1) {
+          flow_t delta = flow_t(qMin(excess_[u], sum_t(cap_[a])));
+          cap_[a] -= delta;
+          cap_[sister<K>(a)] += delta;
+          excess_[u] -= delta;
+          excess_[v] += delta;
+          if (v >= band.first && v < band.last) enqueue(band, v);
+        }
+        if (cap_[a] > Traits::epsilon()) lowest = qMin(lowest, label_[v]);
+      }
+
+      if (excess_[u] > Traits::epsilon()) {
+        label_[u] = qMin(lowest + 1, size_);
+        work += first<K>(u + 1) - first<K>(u) + 1;
+      }
+    }
+  }
+
+  band.queue.erase(band.queue.begin(), band.queue.begin() + pos);
+  band.work += work;
+}
+
+// Parallel region-pushing variant of Goldberg-Tarjan push-relabel. Only computes
+// a maximum preflow: the source side of the cut is every node that can no longer
+// reach the sink, so the cut value matches the other engines.
+template <class Cap>
+void BasicGraph<Cap>::pushRelabel() {
+  switch (connectivity_) {
+  case 4: pushRelabel<4>(); break;
+  case 8: pushRelabel<8>(); break;
+  default: pushRelabel<0>(); break;
+  }
+}
+
+template <class Cap>
+template <int K>
+void BasicGraph<Cap>::pushRelabel() {
+  label_.fill(0, size_);
+  excess_.fill(0, size_);
+  active_.fill(false, size_);
+  queue_.resize(size_);
+
+  for (auto s : source_nodes_) {
+    excess_[s] += source_cap_[s];
+    source_cap_[s] = 0;
+    terminals_[s] |= SourceFlow;
+  }
+
+  QVector<Band> bands;
+  int height = image_size_.height(), width = image_size_.width();
+  int count = connectivity_ ? qMin(2*threads_, height / 2) : 1;
+  if (count < 2 || threads_ == 1) {
+    bands << Band{0, size_, QVector<int>(), 0};
+  }
+  else {
+    for (int b = 0; b < count; ++b) {
+      int y0 = height*b / count, y1 = height*(b + 1) / count;
+      bands << Band{y0*width, y1*width, QVector<int>(), 0};
+    }
+  }
+
+  auto rescan = [this, &bands](int b) {
+    Band& band = bands[b];
+    for (int i = band.first; i < band.last; ++i) {
+      enqueue(band, i);
+    }
+  };
+
+  // rows next to the other bands may have got excess while the band was idle
+  auto sweep = [this, &bands, width](int b) {
+    Band& band = bands[b];
+    if (bands.size() > 1) {
+      for (int i = band.first; i < band.first + width; ++i) enqueue(band, i);
+      for (int i = band.last - width; i < band.last; ++i) enqueue(band, i);
+    }
+    discharge<K>(band);
+  };
+
+  // the threads are started once, every parity and every relabel is a barrier
+  WorkerPool pool(bands.size() > 1 ? threads_ : 1);
+  std::unique_ptr<std::atomic<bool>[]> claimed(pool.size() > 1 ? new std::atomic<bool>[size_] : nullptr);
+  int relabels = 1;
+
+  globalRelabel<K>(pool, claimed.get());
+  pool.run(bands.size(), rescan);
+
+  while (!cancelled()) {
+    int work = 0, pending = 0;
+    for (int parity = 0; parity < 2; ++parity) {
+      QVector<int> turn;
+      for (int b = parity; b < bands.size(); b += 2) turn << b;
+      pool.run(turn.size(), [&](int k) { sweep(turn[k]); });
+    }
+
+    for (auto& band : bands) {
+      work += band.work;
+      pending += band.queue.size();
+    }
+
+    // relabel globally after about one relabelling per node
+    if (pending && work < size_) continue;
+
+    globalRelabel<K>(pool, claimed.get());
+    ++relabels;
+    pending = 0;
+    for (auto& band : bands) band.work = 0;
+    pool.run(bands.size(), rescan);
+    for (auto& band : bands) pending += band.queue.size();
+    if (!pending) break;
+  }
+  Trace::count("graph.globalRelabels", relabels);
+
+  pool.run(bands.size(), [this, &bands](int b) {
+    for (int i = bands[b].first; i < bands[b].last; ++i) {
+      visited_[i] = label_[i] >= size_;
+    }
+  });
+  visited_[size_] = true;
+  visited_[size_ + 1] = false;
+}
+
+// the rest of the members are instantiated in graph.cpp
+template void BasicGraph<float>::setThreadCount(int);
+template void BasicGraph<qint32>::setThreadCount(int);
+template void BasicGraph<qint16>::setThreadCount(int);
+template int BasicGraph<float>::threadCount() const;
+template int BasicGraph<qint32>::threadCount() const;
+template int BasicGraph<qint16>::threadCount() const;
+template void BasicGraph<float>::pushRelabel();
+template void BasicGraph<qint32>::pushRelabel();
+template void BasicGraph<qint16>::pushRelabel();
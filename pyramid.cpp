@@ -0,0 +1,244 @@
+#include "pyramid.h"
+#include "trace.h"
+#include <QtMath>
+
+using namespace std;
+
+// neighbours with a greater index, each pair of pixels is looked at once
+static const int dx4[] = {1, 0};
+static const int dy4[] = {0, 1};
+static const int dx8[] = {1, -1, 0, 1};
+static const int dy8[] = {0, 1, 1, 1};
+
+namespace {
+
+bool isActive(const Matrix<uint8_t>& mask, int x, int y) {
+  return mask.isNull() || mask(x, y);
+}
+
+// a coarse pixel is inside of the mask if any of its fine pixels is
+Matrix<uint8_t> halveMask(const Matrix<uint8_t>& mask, const QSize& size) {
+  if (mask.isNull()) return Matrix<uint8_t>();
+
+  Matrix<uint8_t> half(size, 0);
+  for (int y = 0; y < mask.height(); ++y) {
+    for (int x = 0; x < mask.width(); ++x) {
+      if (mask(x, y)) half(x / 2, y / 2) = 1;
+    }
+  }
+
+  return half;
+}
+
+QVector<int> halveSeeds(const QVector<int>& seeds, int width, const QSize& size) {
+  Matrix<uint8_t> taken(size, 0);
+  QVector<int> half;
+  for (auto seed : seeds) {
+    int x = (seed % width) / 2, y = (seed / width) / 2;
+    if (!taken(x, y)) {
+      taken(x, y) = 1;
+      half << x + y*size.width();
+    }
+  }
+
+  return half;
+}
+
+}
+
+Pyramid::Pyramid(int band, int min_size):
+  band_(qMax(1, band)),
+  min_size_(qMax(2, min_size))
+{
+
+}
+
+void Pyramid::setBand(int band) {
+  band_ = qMax(1, band);
+}
+
+int Pyramid::band() const {
+  return band_;
+}
+
+void Pyramid::setMinSize(int min_size) {
+  min_size_ = qMax(2, min_size);
+}
+
+int Pyramid::minSize() const {
+  return min_size_;
+}
+
+void Pyramid::setEngine(Graph::Engine engine) {
+  engine_ = engine;
+}
+
+void Pyramid::setConnectivity(Graph::Connectivity connectivity) {
+  connectivity_ = connectivity;
+}
+
+Matrix<uint8_t> Pyramid::segment(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks,
+                                 const NLinks& weights) {
+  Q_ASSERT(image.format() == QImage::Format::Format_RGB888);
+
+  if (qMin(image.width(), image.height()) / 2 < min_size_) {
+    return solve(image, mask, sources, sinks);
+  }
+
+  QSize size((image.width() + 1) / 2, (image.height() + 1) / 2);
+  auto half = image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).convertToFormat(QImage::Format_RGB888);
+  auto coarse = segment(half, halveMask(mask, size), halveSeeds(sources, image.width(), size), halveSeeds(sinks, image.width(), size));
+
+  Matrix<uint8_t> labels(image.size(), Unlabelled);
+  for (int y = 0; y < image.height(); ++y) {
+    for (int x = 0; x < image.width(); ++x) {
+      if (isActive(mask, x, y)) labels(x, y) = coarse(x / 2, y / 2);
+    }
+  }
+
+  return refine(image, mask, std::move(labels), sources, sinks, weights);
+}
+
+// the coarsest level is cut as a whole
+Matrix<uint8_t> Pyramid::solve(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks) {
+  Trace::Scope scope("pyramid.solve");
+  auto graph = Graph::fromImage(image, mask, connectivity_);
+  auto cut = graph.minCut(sources, sinks, engine_);
+
+  Matrix<bool> foreground(image.size(), false);
+  graph.fillMask(cut, foreground);
+
+  Matrix<uint8_t> labels(image.size(), Unlabelled);
+  for (int y = 0; y < image.height(); ++y) {
+    for (int x = 0; x < image.width(); ++x) {
+      if (isActive(mask, x, y)) labels(x, y) = foreground(x, y) ? Foreground : Background;
+    }
+  }
+
+  return labels;
+}
+
+Matrix<uint8_t> Pyramid::refine(const QImage& image, const Matrix<uint8_t>& mask, Matrix<uint8_t> labels,
+                                const QVector<int>& sources, const QVector<int>& sinks, const NLinks& weights) {
+  Trace::Scope scope("pyramid.refine");
+  const int w = image.width(), h = image.height();
+
+  // the band grows from the rough boundary, from pixels which were
+  // left without a label and from seeds that disagree with the rough labels
+  Matrix<int> dist(image.size(), -1);
+  QVector<int> queue;
+  auto start = [&](int x, int y) {
+    if (dist(x, y) < 0 && isActive(mask, x, y)) {
+      dist(x, y) = 0;
+      queue << x + y*w;
+    }
+  };
+
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      if (!isActive(mask, x, y)) continue;
+      uint8_t label = labels(x, y);
+      if (label == Unlabelled ||
+          (x + 1 < w && isActive(mask, x + 1, y) && labels(x + 1, y) != label) ||
+          (y + 1 < h && isActive(mask, x, y + 1) && labels(x, y + 1) != label)) {
+        start(x, y);
+        if (x + 1 < w) start(x + 1, y);
+        if (y + 1 < h) start(x, y + 1);
+      }
+    }
+  }
+  for (auto s : sources) {
+    if (labels(s % w, s / w) != Foreground) start(s % w, s / w);
+  }
+  for (auto t : sinks) {
+    if (labels(t % w, t / w) != Background) start(t % w, t / w);
+  }
+
+  static const int dx[] = {-1, 1, 0, 0};
+  static const int dy[] = {0, 0, -1, 1};
+  for (int head = 0; head < queue.size(); ++head) {
+    int x = queue[head] % w, y = queue[head] / w;
+    if (dist(x, y) == band_) continue;
+
+    for (int k = 0; k < 4; ++k) {
+      int nx = x + dx[k], ny = y + dy[k];
+      if (nx < 0 || nx >= w || ny < 0 || ny >= h) continue;
+      if (dist(nx, ny) >= 0 || !isActive(mask, nx, ny)) continue;
+
+      dist(nx, ny) = dist(x, y) + 1;
+      queue << nx + ny*w;
+    }
+  }
+
+  if (queue.isEmpty()) return labels;
+
+  // nodes are the band and the ring of pixels around it,
+  // the ring is tied to the terminals by its rough labels
+  const int k_count = static_cast<int>(connectivity_) / 2;
+  const int* fx = k_count == 2 ? dx4 : dx8;
+  const int* fy = k_count == 2 ? dy4 : dy8;
+
+  Matrix<int> node(image.size(), -1);
+  QVector<int> pixels = queue;
+  for (int i = 0; i < pixels.size(); ++i) {
+    node(pixels[i] % w, pixels[i] / w) = i;
+  }
+
+  QVector<int> node_sources, node_sinks;
+  int band_nodes = pixels.size();
+  for (int i = 0; i < band_nodes; ++i) {
+    int x = pixels[i] % w, y = pixels[i] / w;
+    for (int k = 0; k < 2*k_count; ++k) {
+      // backward neighbours are the forward ones mirrored
+      int nx = k < k_count ? x + fx[k] : x - fx[k - k_count];
+      int ny = k < k_count ? y + fy[k] : y - fy[k - k_count];
+      if (nx < 0 || nx >= w || ny < 0 || ny >= h) continue;
+      if (node(nx, ny) >= 0 || !isActive(mask, nx, ny)) continue;
+
+      node(nx, ny) = pixels.size();
+      pixels << nx + ny*w;
+      if (labels(nx, ny) == Foreground) node_sources << node(nx, ny);
+      else node_sinks << node(nx, ny);
+    }
+  }
+
+  for (auto s : sources) {
+    int i = node(s % w, s / w);
+    if (i >= 0 && i < band_nodes) node_sources << i;
+  }
+  for (auto t : sinks) {
+    int i = node(t % w, t / w);
+    if (i >= 0 && i < band_nodes) node_sinks << i;
+  }
+
+  // the forward neighbours above are in the order of the planes of NLinks
+  bool cached = !weights.isNull() && weights.size() == image.size() && weights.connectivity() == connectivity_;
+  Graph graph(pixels.size(), QSize(pixels.size(), 1));
+  for (int i = 0; i < pixels.size(); ++i) {
+    int x = pixels[i] % w, y = pixels[i] / w;
+    const uchar* p = image.constScanLine(y) + 3*x;
+    for (int k = 0; k < k_count; ++k) {
+      int nx = x + fx[k], ny = y + fy[k];
+      if (nx < 0 || nx >= w || ny >= h) continue;
+
+      // arcs between two ring pixels can't be cut
+      int j = node(nx, ny);
+      if (j < 0 || (i >= band_nodes && j >= band_nodes)) continue;
+
+      const uchar* q = image.constScanLine(ny) + 3*nx;
+      float weight = cached ? weights.weight(pixels[i], k) : Graph::nlinkWeight(p, q, qSqrt(float(fx[k]*fx[k] + fy[k]*fy[k])));
+      graph.addEdge(i, j, weight);
+      graph.addEdge(j, i, weight);
+    }
+  }
+
+  auto cut = graph.minCut(node_sources, node_sinks, engine_);
+  for (int i = 0; i < band_nodes; ++i) {
+    labels(pixels[i] % w, pixels[i] / w) = Background;
+  }
+  for (auto i : graph.getForeground(cut)) {
+    if (i < band_nodes) labels(pixels[i] % w, pixels[i] / w) = Foreground;
+  }
+
+  return labels;
+}
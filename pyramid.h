@@ -0,0 +1,50 @@
+#pragma once
+#include <QImage>
+#include <QVector>
+#include <stdint.h>
+
+#include "graph.h"
+#include "matrix.h"
+
+// Coarse-to-fine min-cut for large images. The image and the seeds are halved
+// until the shorter side gets below 'min_size', the coarsest level is cut as
+// a whole and every finer level only solves a narrow band around the upsampled
+// boundary, the pixels outside of the band keep the upsampled labels.
+class Pyramid {
+public:
+  enum Label : uint8_t {
+    Background = 0,
+    Foreground = 1,
+    Unlabelled = 2 // outside of the mask
+  };
+
+  explicit Pyramid(int band = 4, int min_size = 256);
+
+  // half width of the band around the boundary, in pixels of every level
+  void setBand(int band);
+  int band() const;
+
+  void setMinSize(int min_size);
+  int minSize() const;
+
+  void setEngine(Graph::Engine engine);
+  void setConnectivity(Graph::Connectivity connectivity);
+
+  // Labels of the pixels of 'image' for the same input as Graph::fromImage and minCut.
+  // The band of 'image' takes its n-links from 'weights' if they are of the same
+  // image and connectivity.
+  Matrix<uint8_t> segment(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks,
+                          const NLinks& weights = NLinks());
+
+  // cuts again the band around the boundary of rough full resolution labels
+  Matrix<uint8_t> refine(const QImage& image, const Matrix<uint8_t>& mask, Matrix<uint8_t> labels,
+                         const QVector<int>& sources, const QVector<int>& sinks, const NLinks& weights = NLinks());
+
+private:
+  int band_;
+  int min_size_;
+  Graph::Engine engine_ = Graph::Engine::BoykovKolmogorov;
+  Graph::Connectivity connectivity_ = Graph::Connectivity::Four;
+
+  Matrix<uint8_t> solve(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks);
+};
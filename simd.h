@@ -0,0 +1,109 @@
+#pragma once
+#include <cmath>
+#include <stdint.h>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+namespace simd {
+
+const float exp_lo = -87.0f;
+const float exp_hi = 88.0f;
+const float log2e = 1.44269504088896341f;
+const float ln2_hi = 0.693359375f;
+const float ln2_lo = -2.12194440e-4f;
+const float p0 = 1.9875691500e-4f, p1 = 1.3981999507e-3f, p2 = 8.3334519073e-3f;
+const float p3 = 4.1665795894e-2f, p4 = 1.6666665459e-1f, p5 = 5.0000001201e-1f;
+
+// exp(x) by the Cephes range reduction: x = n*ln2 + r, exp(x) = 2^n * p(r).
+// Relative error is within a couple of float ulps, arguments below -87 give 0
+// instead of denormals. The vector versions compute exactly the same thing.
+inline float exp(float x) {
+  if (x < exp_lo) return 0;
+  if (x > exp_hi) x = exp_hi;
+
+  float n = std::nearbyint(x*log2e);
+  float r = x - n*ln2_hi - n*ln2_lo;
+  float p = ((((p0*r + p1)*r + p2)*r + p3)*r + p4)*r + p5;
+  p = p*r*r + r + 1.0f;
+
+  int32_t bits = (int32_t(n) + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p*scale;
+}
+
+#if defined(__AVX2__)
+inline __m256 exp(__m256 x) {
+  __m256 underflow = _mm256_cmp_ps(x, _mm256_set1_ps(exp_lo), _CMP_LT_OQ);
+  x = _mm256_min_ps(x, _mm256_set1_ps(exp_hi));
+
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(ln2_hi)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(ln2_lo)));
+
+  __m256 p = _mm256_set1_ps(p0);
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(p1));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(p2));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(p3));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(p4));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(p5));
+  p = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, r), r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+  __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_andnot_ps(underflow, _mm256_mul_ps(p, _mm256_castsi256_ps(bits)));
+}
+#elif defined(SIMD_SSE2)
+inline __m128 exp(__m128 x) {
+  __m128 underflow = _mm_cmplt_ps(x, _mm_set1_ps(exp_lo));
+  x = _mm_min_ps(x, _mm_set1_ps(exp_hi));
+
+  // the default rounding mode rounds to nearest, like nearbyint
+  __m128i n_int = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(log2e)));
+  __m128 n = _mm_cvtepi32_ps(n_int);
+  __m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(ln2_hi)));
+  r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(ln2_lo)));
+
+  __m128 p = _mm_set1_ps(p0);
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(p1));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(p2));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(p3));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(p4));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(p5));
+  p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+
+  __m128i bits = _mm_slli_epi32(_mm_add_epi32(n_int, _mm_set1_epi32(127)), 23);
+  return _mm_andnot_ps(underflow, _mm_mul_ps(p, _mm_castsi128_ps(bits)));
+}
+#endif
+
+// n-link weights of a row of pixel pairs from their squared colour distances:
+// weights[i] = exp(-sqrt(distance2[i]) / (2*sigma)) / length
+inline void nlinkWeights(const float* distance2, float* weights, int count, float sigma, float length) {
+  int i = 0;
+
+#if defined(__AVX2__)
+  const __m256 two_sigma = _mm256_set1_ps(-2.0f*sigma), len = _mm256_set1_ps(length);
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_div_ps(_mm256_sqrt_ps(_mm256_loadu_ps(distance2 + i)), two_sigma);
+    _mm256_storeu_ps(weights + i, _mm256_div_ps(exp(x), len));
+  }
+#elif defined(SIMD_SSE2)
+  const __m128 two_sigma = _mm_set1_ps(-2.0f*sigma), len = _mm_set1_ps(length);
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_div_ps(_mm_sqrt_ps(_mm_loadu_ps(distance2 + i)), two_sigma);
+    _mm_storeu_ps(weights + i, _mm_div_ps(exp(x), len));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    weights[i] = exp(std::sqrt(distance2[i]) / (-2.0f*sigma)) / length;
+  }
+}
+
+}
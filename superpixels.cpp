@@ -0,0 +1,264 @@
+#include "superpixels.h"
+#include "parallel.h"
+#include "pyramid.h"
+#include "trace.h"
+#include <algorithm>
+
+using namespace std;
+
+Superpixels::Superpixels(const QImage& image, int size, float compactness, int iterations, int threads,
+                         const NLinks& weights):
+  size_(qMax(2, size)),
+  threads_(qMax(1, threads)),
+  compactness_(compactness)
+{
+  Q_ASSERT(image.format() == QImage::Format::Format_RGB888);
+  Trace::Scope scope("superpixels.slic");
+
+  const int w = image.width(), h = image.height();
+  grid_width_ = (w + size_ - 1) / size_;
+  grid_height_ = (h + size_ - 1) / size_;
+  labels_ = Matrix<int>(w, h, -1);
+
+  // centres start in the middle of the cells of a regular grid
+  for (int gy = 0; gy < grid_height_; ++gy) {
+    for (int gx = 0; gx < grid_width_; ++gx) {
+      int x = qMin(w - 1, gx*size_ + size_ / 2), y = qMin(h - 1, gy*size_ + size_ / 2);
+      const uchar* p = image.constScanLine(y) + 3*x;
+      centres_ << Centre{float(p[0]), float(p[1]), float(p[2]), float(x), float(y)};
+    }
+  }
+
+  int bands = qMax(1, qMin(h, 4*threads_));
+  for (int i = 0; i < iterations; ++i) {
+    parallelFor(bands, threads_, [&](int band) {
+      assign(image, band*h / bands, (band + 1)*h / bands);
+    });
+    parallelFor(grid_height_, threads_, [&](int row) {
+      update(image, row);
+    });
+  }
+
+  if (!iterations) {
+    assign(image, 0, h);
+  }
+
+  link(image, weights);
+}
+
+// Finds the pixel pairs on the region boundaries and sums their n-links up
+// per pair of regions. The pairs are kept in the order of the pixels, so a
+// masked sum adds the same numbers in the same order as the full one.
+void Superpixels::link(const QImage& image, const NLinks& weights) {
+  Trace::Scope scope("superpixels.link");
+  const int w = image.width(), h = image.height();
+
+  // the right and the lower neighbours are planes 0 and 1 of a 4-connected NLinks, 0 and 2 of an 8-connected one
+  bool cached = !weights.isNull() && weights.size() == image.size();
+  const float* right = cached ? weights.plane(0) : nullptr;
+  const float* down = cached ? weights.plane(weights.connectivity() == Graph::Connectivity::Four ? 1 : 2) : nullptr;
+
+  struct Entry {
+    int a, b;
+    Pair pair;
+  };
+
+  int bands = qMax(1, qMin(h, 4*threads_));
+  QVector<QVector<Entry>> found(bands);
+  parallelFor(bands, threads_, [&](int band) {
+    for (int y = band*h / bands, y1 = (band + 1)*h / bands; y < y1; ++y) {
+      const uchar* line = image.constScanLine(y);
+      for (int x = 0; x < w; ++x) {
+        int a = labels_(x, y), i = x + y*w;
+        if (x + 1 < w && labels_(x + 1, y) != a) {
+          int b = labels_(x + 1, y);
+          float weight = cached ? right[i] : Graph::nlinkWeight(line + 3*x, line + 3*(x + 1), 1.0f);
+          found[band] << Entry{qMin(a, b), qMax(a, b), Pair{2*quint32(i), weight}};
+        }
+        if (y + 1 < h && labels_(x, y + 1) != a) {
+          int b = labels_(x, y + 1);
+          float weight = cached ? down[i] : Graph::nlinkWeight(line + 3*x, image.constScanLine(y + 1) + 3*x, 1.0f);
+          found[band] << Entry{qMin(a, b), qMax(a, b), Pair{2*quint32(i) + 1, weight}};
+        }
+      }
+    }
+  });
+
+  // the pairs are bucketed by their lower region, then every bucket is sorted by the other one
+  QVector<int> start(count() + 1, 0);
+  for (auto& band : found) {
+    for (auto& entry : band) ++start[entry.a + 1];
+  }
+  for (int a = 0; a < count(); ++a) {
+    start[a + 1] += start[a];
+  }
+
+  QVector<Entry> entries(start.last());
+  QVector<int> next = start;
+  for (auto& band : found) {
+    for (auto& entry : band) entries[next[entry.a]++] = entry;
+    band = QVector<Entry>();
+  }
+
+  links_.clear();
+  pair_first_.clear();
+  pairs_.clear();
+  pairs_.reserve(entries.size());
+  for (int a = 0; a < count(); ++a) {
+    stable_sort(entries.begin() + start[a], entries.begin() + start[a + 1],
+                [](const Entry& l, const Entry& r) { return l.b < r.b; });
+    for (int e = start[a]; e < start[a + 1]; ++e) {
+      if (e == start[a] || entries[e].b != entries[e - 1].b) {
+        pair_first_ << e;
+        links_ << Link{a, entries[e].b, 0.0f};
+      }
+      links_.last().weight += entries[e].pair.weight;
+      pairs_ << entries[e].pair;
+    }
+  }
+  pair_first_ << entries.size();
+}
+
+// Every pixel picks the closest of the centres of its own and the eight
+// neighbouring grid cells, so rows of pixels are assigned independently.
+void Superpixels::assign(const QImage& image, int y0, int y1) {
+  const float spatial = compactness_*compactness_ / (size_*size_);
+  const int w = image.width();
+
+  for (int y = y0; y < y1; ++y) {
+    const uchar* line = image.constScanLine(y);
+    int gy = y / size_;
+    for (int x = 0; x < w; ++x) {
+      const uchar* p = line + 3*x;
+      int gx = x / size_, best = -1;
+      float best_distance = numeric_limits<float>::max();
+
+      for (int cy = qMax(0, gy - 1); cy <= qMin(grid_height_ - 1, gy + 1); ++cy) {
+        for (int cx = qMax(0, gx - 1); cx <= qMin(grid_width_ - 1, gx + 1); ++cx) {
+          const Centre& c = centres_[cx + cy*grid_width_];
+          float dr = p[0] - c.r, dg = p[1] - c.g, db = p[2] - c.b;
+          float dx = x - c.x, dy = y - c.y;
+          float distance = dr*dr + dg*dg + db*db + spatial*(dx*dx + dy*dy);
+          if (distance < best_distance) {
+            best_distance = distance;
+            best = cx + cy*grid_width_;
+          }
+        }
+      }
+
+      labels_(x, y) = best;
+    }
+  }
+}
+
+// Moves the centres of a grid row to the mean of their pixels, which can
+// only lie in the pixel rows of the grid row and of its neighbours.
+void Superpixels::update(const QImage& image, int row) {
+  QVector<double> sums(5*grid_width_, 0);
+  QVector<int> counts(grid_width_, 0);
+
+  int y0 = qMax(0, (row - 1)*size_), y1 = qMin(image.height(), (row + 2)*size_);
+  for (int y = y0; y < y1; ++y) {
+    const uchar* line = image.constScanLine(y);
+    const int* labels = labels_.line(y);
+    for (int x = 0; x < image.width(); ++x) {
+      if (labels[x] / grid_width_ != row) continue;
+
+      int c = labels[x] % grid_width_;
+      const uchar* p = line + 3*x;
+      sums[5*c] += p[0];
+      sums[5*c + 1] += p[1];
+      sums[5*c + 2] += p[2];
+      sums[5*c + 3] += x;
+      sums[5*c + 4] += y;
+      ++counts[c];
+    }
+  }
+
+  for (int c = 0; c < grid_width_; ++c) {
+    if (!counts[c]) continue;
+
+    Centre& centre = centres_[c + row*grid_width_];
+    centre.r = sums[5*c] / counts[c];
+    centre.g = sums[5*c + 1] / counts[c];
+    centre.b = sums[5*c + 2] / counts[c];
+    centre.x = sums[5*c + 3] / counts[c];
+    centre.y = sums[5*c + 4] / counts[c];
+  }
+}
+
+bool Superpixels::isNull() const {
+  return centres_.isEmpty();
+}
+
+int Superpixels::count() const {
+  return centres_.size();
+}
+
+int Superpixels::size() const {
+  return size_;
+}
+
+const Matrix<int>& Superpixels::labels() const {
+  return labels_;
+}
+
+Matrix<uint8_t> Superpixels::segment(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks,
+                                     Graph::Engine engine, int band, const NLinks& weights) {
+  Trace::Scope scope("superpixels.segment");
+  const int w = image.width(), h = image.height();
+  auto active = [&mask](int x, int y) {
+    return mask.isNull() || mask(x, y);
+  };
+
+  // only the pairs of pixels inside of the mask are summed up again
+  Graph graph(count(), QSize(count(), 1));
+  for (int l = 0; l < links_.size(); ++l) {
+    float weight = links_[l].weight;
+    if (!mask.isNull()) {
+      bool linked = false;
+      weight = 0;
+      for (int p = pair_first_[l]; p < pair_first_[l + 1]; ++p) {
+        int x = (pairs_[p].pixels / 2) % w, y = (pairs_[p].pixels / 2) / w;
+        bool down = pairs_[p].pixels & 1;
+        if (active(x, y) && active(down ? x : x + 1, down ? y + 1 : y)) {
+          weight += pairs_[p].weight;
+          linked = true;
+        }
+      }
+      if (!linked) continue;
+    }
+
+    graph.addEdge(links_[l].a, links_[l].b, weight);
+    graph.addEdge(links_[l].b, links_[l].a, weight);
+  }
+
+  QVector<int> region_sources, region_sinks;
+  for (auto s : sources) {
+    if (active(s % w, s / w)) region_sources << labels_(s % w, s / w);
+  }
+  for (auto t : sinks) {
+    if (active(t % w, t / w)) region_sinks << labels_(t % w, t / w);
+  }
+
+  graph.minCut(region_sources, region_sinks, engine);
+  QVector<uint8_t> region_labels(count(), Pyramid::Background);
+  for (auto region : graph.sourceSide()) {
+    region_labels[region] = Pyramid::Foreground;
+  }
+
+  Matrix<uint8_t> labels(image.size(), Pyramid::Unlabelled);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      if (active(x, y)) labels(x, y) = region_labels[labels_(x, y)];
+    }
+  }
+
+  if (band <= 0) return labels;
+
+  // regions holding seeds of both kinds and thin details lost
+  // by the regions are fixed by the full resolution band
+  Pyramid pyramid(band);
+  pyramid.setEngine(engine);
+  return pyramid.refine(image, mask, std::move(labels), sources, sinks, weights);
+}
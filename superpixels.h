@@ -0,0 +1,68 @@
+#pragma once
+#include <QImage>
+#include <QThread>
+#include <QVector>
+#include <stdint.h>
+
+#include "graph.h"
+#include "matrix.h"
+
+// SLIC over-segmentation of an image into compact regions of about size*size
+// pixels. The cut runs on the region adjacency graph, whose arcs carry the sum
+// of the pixel n-links between two regions, so a region cut costs exactly what
+// cutting its pixels apart would. The adjacency is built with the regions, the
+// n-links are taken from 'weights' unless it is null.
+class Superpixels {
+public:
+  Superpixels() = default;
+  explicit Superpixels(const QImage& image, int size = 16, float compactness = 10.0f, int iterations = 5,
+                       int threads = QThread::idealThreadCount(), const NLinks& weights = NLinks());
+
+  bool isNull() const;
+  int count() const;
+  int size() const;
+
+  // region of every pixel
+  const Matrix<int>& labels() const;
+
+  // Region labels of the pixels inside of 'mask' (Pyramid::Label values). Seeds
+  // outside of 'mask' are ignored. With a positive 'band' the boundary is cut
+  // again at full resolution by Pyramid::refine, which takes the n-links from
+  // 'weights' unless it is null.
+  Matrix<uint8_t> segment(const QImage& image, const Matrix<uint8_t>& mask, const QVector<int>& sources, const QVector<int>& sinks,
+                          Graph::Engine engine = Graph::Engine::BoykovKolmogorov, int band = 0, const NLinks& weights = NLinks());
+
+private:
+  struct Centre {
+    float r, g, b, x, y;
+  };
+
+  // pixel i and its right neighbour of another region are 2*i, i and the
+  // lower one are 2*i + 1
+  struct Pair {
+    quint32 pixels;
+    float weight;
+  };
+
+  // regions a < b with the sum of the n-links between them
+  struct Link {
+    int a, b;
+    float weight;
+  };
+
+  int size_ = 0;
+  int grid_width_ = 0, grid_height_ = 0;
+  int threads_ = 1;
+  float compactness_ = 0;
+  Matrix<int> labels_;
+  QVector<Centre> centres_;
+
+  // the pairs of link l are pairs_[pair_first_[l]] to pairs_[pair_first_[l + 1] - 1]
+  QVector<Link> links_;
+  QVector<int> pair_first_;
+  QVector<Pair> pairs_;
+
+  void assign(const QImage& image, int y0, int y1);
+  void update(const QImage& image, int row);
+  void link(const QImage& image, const NLinks& weights);
+};
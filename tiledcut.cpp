@@ -0,0 +1,184 @@
+#include "tiledcut.h"
+#include "parallel.h"
+#include "pyramid.h"
+#include "trace.h"
+#include <QImageReader>
+#include <QtMath>
+#include <QFile>
+
+using namespace std;
+
+namespace {
+
+// seeds inside of 'rect' as pixel indices of the part of the image
+QVector<int> localSeeds(const QVector<QPoint>& seeds, const QRect& rect) {
+  QVector<int> local;
+  for (auto& seed : seeds) {
+    if (rect.contains(seed)) local << (seed.x() - rect.x()) + (seed.y() - rect.y())*rect.width();
+  }
+
+  return local;
+}
+
+QVector<int> scaledSeeds(const QVector<QPoint>& seeds, const QSize& size, const QSize& small) {
+  Matrix<uint8_t> taken(small, 0);
+  QVector<int> scaled;
+  for (auto& seed : seeds) {
+    int x = qint64(seed.x())*small.width() / size.width();
+    int y = qint64(seed.y())*small.height() / size.height();
+    if (!taken(x, y)) {
+      taken(x, y) = 1;
+      scaled << x + y*small.width();
+    }
+  }
+
+  return scaled;
+}
+
+}
+
+TiledCut::TiledCut(int tile, int band, int preview):
+  tile_(qMax(16, tile)),
+  band_(qMax(1, band)),
+  preview_(qMax(16, preview))
+{
+
+}
+
+void TiledCut::setThreads(int threads) {
+  threads_ = qMax(1, threads);
+}
+
+void TiledCut::setEngine(Graph::Engine engine) {
+  engine_ = engine;
+}
+
+void TiledCut::setConnectivity(Graph::Connectivity connectivity) {
+  connectivity_ = connectivity;
+}
+
+QString TiledCut::errorString() const {
+  return error_;
+}
+
+QImage TiledCut::read(const QRect& rect) const {
+  // a reader reads one image, every strip opens the file again
+  QImageReader reader(filename_);
+  reader.setClipRect(rect);
+  return reader.read().convertToFormat(QImage::Format_RGB888);
+}
+
+Matrix<uint8_t> TiledCut::cutPreview(const QSize& size, const QVector<QPoint>& sources, const QVector<QPoint>& sinks) {
+  Trace::Scope scope("tiled.preview");
+  QSize small = size;
+  if (qMax(size.width(), size.height()) > preview_) {
+    small.scale(preview_, preview_, Qt::KeepAspectRatio);
+    small = small.expandedTo(QSize(1, 1));
+  }
+
+  // jpeg is decoded straight into the smaller size
+  QImageReader reader(filename_);
+  reader.setScaledSize(small);
+  QImage preview = reader.read();
+  if (preview.isNull()) {
+    error_ = "can't read a preview of " + filename_;
+    return Matrix<uint8_t>();
+  }
+  preview = preview.convertToFormat(QImage::Format_RGB888);
+
+  Pyramid pyramid(band_);
+  pyramid.setEngine(engine_);
+  pyramid.setConnectivity(connectivity_);
+  return pyramid.segment(preview, Matrix<uint8_t>(), scaledSeeds(sources, size, small), scaledSeeds(sinks, size, small));
+}
+
+bool TiledCut::segment(const QString& image, const QVector<QPoint>& sources, const QVector<QPoint>& sinks, const QString& output) {
+  error_.clear();
+  filename_ = image;
+
+  QImageReader reader(image);
+  const QSize size = reader.size();
+  if (!size.isValid()) {
+    error_ = "can't read image " + image;
+    return false;
+  }
+  if (!reader.supportsOption(QImageIOHandler::ClipRect)) {
+    // reading it whole would take the memory the tiles are meant to save
+    error_ = image + " can't be read in parts, tiles need a format that can, such as JPEG";
+    return false;
+  }
+
+  auto rough = cutPreview(size, sources, sinks);
+  if (rough.isNull()) return false;
+
+  // the preview boundary is off by up to a preview pixel, the band covers it,
+  // and the margin keeps the tile edges away from the band of the core
+  const int w = size.width(), h = size.height();
+  const int band = band_ + qCeil(qMax(double(w) / rough.width(), double(h) / rough.height()));
+  const int margin = 2*band;
+
+  QFile file(output);
+  const QByteArray header = QString("P5\n%1 %2\n255\n").arg(w).arg(h).toLatin1();
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(header) != header.size()) {
+    error_ = "can't write mask " + output;
+    return false;
+  }
+
+  // The tile rows are read one after another as strips of whole rows with the
+  // margins, the tiles of a row are cut in parallel from its strip. A clip read
+  // of jpeg still decodes the rows above the strip, so this decodes the image
+  // once per tile row instead of once per tile.
+  const QRect bounds(QPoint(0, 0), size);
+  const int columns = (w + tile_ - 1) / tile_, rows = (h + tile_ - 1) / tile_;
+  for (int row = 0; row < rows; ++row) {
+    const QRect cores = QRect(0, row*tile_, w, tile_) & bounds;
+    const QRect area = cores.adjusted(0, -margin, 0, margin) & bounds;
+    QImage strip;
+    {
+      Trace::Scope scope("tiled.strip");
+      strip = read(area);
+    }
+    if (strip.size() != area.size()) {
+      error_ = QString("can't read rows %1-%2 of %3").arg(area.top()).arg(area.bottom()).arg(image);
+      return false;
+    }
+
+    // the cores of the row, in the order of the file
+    QByteArray block(w*cores.height(), 0);
+    char* cells = block.data();
+    parallelFor(columns, threads_, [&](int column) {
+      Trace::Scope scope("tiled.tile");
+
+      QRect core = QRect(column*tile_, cores.y(), tile_, cores.height()) & bounds;
+      QRect rect = core.adjusted(-margin, -margin, margin, margin) & bounds;
+      QImage pixels = strip.copy(rect.translated(0, -area.y()));
+
+      Matrix<uint8_t> labels(rect.size());
+      for (int y = 0; y < rect.height(); ++y) {
+        int ry = qint64(rect.y() + y)*rough.height() / h;
+        for (int x = 0; x < rect.width(); ++x) {
+          labels(x, y) = rough(qint64(rect.x() + x)*rough.width() / w, ry);
+        }
+      }
+
+      Pyramid pyramid(band);
+      pyramid.setEngine(engine_);
+      pyramid.setConnectivity(connectivity_);
+      labels = pyramid.refine(pixels, Matrix<uint8_t>(), std::move(labels), localSeeds(sources, rect), localSeeds(sinks, rect));
+
+      // only the core is written, the margin belongs to the neighbouring tiles
+      for (int y = 0; y < core.height(); ++y) {
+        for (int x = 0; x < core.width(); ++x) {
+          if (labels(core.x() - rect.x() + x, core.y() - rect.y() + y) == Pyramid::Foreground) cells[core.x() + x + y*w] = char(255);
+        }
+      }
+    });
+
+    if (file.write(block) != block.size()) {
+      error_ = "can't write mask " + output;
+      return false;
+    }
+  }
+
+  return true;
+}
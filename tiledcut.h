@@ -0,0 +1,44 @@
+#pragma once
+#include <QImage>
+#include <QPoint>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <stdint.h>
+
+#include "graph.h"
+#include "matrix.h"
+
+// Segmentation of images too large for a graph over all of their pixels.
+// A preview of the whole image is cut first, then the image is read in
+// overlapping tiles and every tile only cuts a band around the upsampled
+// preview boundary (Pyramid::refine). The image is read a tile row at a time
+// and the mask goes to a binary PGM row by row, so besides the preview only
+// one strip of the image is in memory. The format has to read parts of an
+// image (QImageIOHandler::ClipRect), others are rejected.
+class TiledCut {
+public:
+  explicit TiledCut(int tile = 1024, int band = 4, int preview = 2048);
+
+  void setThreads(int threads);
+  void setEngine(Graph::Engine engine);
+  void setConnectivity(Graph::Connectivity connectivity);
+
+  // seeds are points, pixel indices of such images don't fit into int
+  bool segment(const QString& image, const QVector<QPoint>& sources, const QVector<QPoint>& sinks, const QString& output);
+  QString errorString() const;
+
+private:
+  int tile_;
+  int band_;
+  int preview_;
+  int threads_ = QThread::idealThreadCount();
+  Graph::Engine engine_ = Graph::Engine::BoykovKolmogorov;
+  Graph::Connectivity connectivity_ = Graph::Connectivity::Four;
+  QString error_;
+
+  QString filename_;
+
+  QImage read(const QRect& rect) const;
+  Matrix<uint8_t> cutPreview(const QSize& size, const QVector<QPoint>& sources, const QVector<QPoint>& sinks);
+};
@@ -0,0 +1,140 @@
+#include "trace.h"
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QTextStream>
+#include <QThread>
+#include <QVector>
+#include <QMutex>
+#include <QHash>
+#include <QFile>
+
+namespace {
+
+struct Event {
+  const char* name;
+  bool counter;
+  qint64 start;    // ns since the first event
+  double value;    // duration in ns or the counter value
+  Qt::HANDLE thread;
+};
+
+QMutex mutex;
+QVector<Event> events;
+
+void record(const Event& event) {
+  QMutexLocker lock(&mutex);
+  events << event;
+}
+
+QVector<Event> recorded() {
+  QMutexLocker lock(&mutex);
+  return events;
+}
+
+}
+
+std::atomic<bool> Trace::enabled_(false);
+
+void Trace::setEnabled(bool enabled) {
+  now(); // starts the clock
+  enabled_.store(enabled);
+}
+
+void Trace::clear() {
+  QMutexLocker lock(&mutex);
+  events.clear();
+}
+
+qint64 Trace::now() {
+  static const QElapsedTimer clock = []() {
+    QElapsedTimer timer;
+    timer.start();
+    return timer;
+  }();
+
+  return clock.nsecsElapsed();
+}
+
+void Trace::complete(const char* name, qint64 start, qint64 duration) {
+  record(Event{name, false, start, double(duration), QThread::currentThreadId()});
+}
+
+void Trace::counter(const char* name, double value) {
+  record(Event{name, true, now(), value, QThread::currentThreadId()});
+}
+
+QByteArray Trace::chromeJson() {
+  // thread ids are numbered in the order of their first event
+  QHash<Qt::HANDLE, int> threads;
+  QJsonArray trace;
+  for (auto& event : recorded()) {
+    if (!threads.contains(event.thread)) threads.insert(event.thread, threads.size() + 1);
+
+    QJsonObject object;
+    object["name"] = event.name;
+    object["cat"] = "segmentation";
+    object["pid"] = 1;
+    object["tid"] = threads[event.thread];
+    object["ts"] = event.start / 1e3;
+    if (event.counter) {
+      object["ph"] = "C";
+      object["args"] = QJsonObject{{"value", event.value}};
+    }
+    else {
+      object["ph"] = "X";
+      object["dur"] = event.value / 1e3;
+    }
+    trace << object;
+  }
+
+  QJsonObject report;
+  report["traceEvents"] = trace;
+  report["displayTimeUnit"] = "ms";
+  return QJsonDocument(report).toJson(QJsonDocument::Compact);
+}
+
+QByteArray Trace::csv() {
+  struct Summary {
+    bool counter;
+    int count;
+    double total, min, max;
+  };
+
+  // stages and counters in the order they first appeared
+  QVector<QByteArray> keys;
+  QHash<QByteArray, Summary> summaries;
+  for (auto& event : recorded()) {
+    QByteArray key = QByteArray(event.counter ? "c:" : "s:") + event.name;
+    double value = event.counter ? event.value : event.value / 1e6;
+    auto it = summaries.find(key);
+    if (it == summaries.end()) {
+      keys << key;
+      it = summaries.insert(key, Summary{event.counter, 0, 0, value, value});
+    }
+    ++it->count;
+    it->total += value;
+    it->min = qMin(it->min, value);
+    it->max = qMax(it->max, value);
+  }
+
+  QByteArray result;
+  QTextStream stream(&result);
+  stream << "kind,name,count,total,mean,min,max\n";
+  for (auto& key : keys) {
+    // times are in milliseconds
+    auto& summary = summaries[key];
+    stream << (summary.counter ? "counter" : "stage") << ',' << key.mid(2) << ',' << summary.count << ','
+           << summary.total << ',' << summary.total / summary.count << ',' << summary.min << ',' << summary.max << '\n';
+  }
+  stream.flush();
+  return result;
+}
+
+bool Trace::save(const QString& filename) {
+  auto data = filename.endsWith(".csv", Qt::CaseInsensitive) ? csv() : chromeJson();
+
+  QFile file(filename);
+  return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+
+// Scoped timers and counters of the segmentation stages. Nothing is recorded
+// until setEnabled(true), a disabled scope costs one relaxed atomic load.
+// The events are saved as a Chrome trace (chrome://tracing, Perfetto) or as
+// a CSV summary with one line per stage and counter.
+class Trace {
+public:
+  // times the enclosing block, 'name' must outlive the trace (a string literal)
+  class Scope {
+  public:
+    explicit Scope(const char* name):
+      name_(name),
+      start_(isEnabled() ? now() : -1)
+    {
+
+    }
+
+    ~Scope() {
+      if (start_ >= 0) complete(name_, start_, now() - start_);
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    const char* name_;
+    qint64 start_; // ns, -1 if the trace was disabled on entry
+  };
+
+  static bool isEnabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void setEnabled(bool enabled);
+
+  // value of a counter at this moment, e.g. the augmenting paths of a cut
+  static void count(const char* name, double value) {
+    if (isEnabled()) counter(name, value);
+  }
+
+  // drops the recorded events
+  static void clear();
+
+  static QByteArray chromeJson();
+  static QByteArray csv();
+
+  // CSV for a .csv file, Chrome trace JSON otherwise
+  static bool save(const QString& filename);
+
+private:
+  static std::atomic<bool> enabled_;
+
+  static qint64 now();
+  static void complete(const char* name, qint64 start, qint64 duration);
+  static void counter(const char* name, double value);
+};
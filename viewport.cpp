@@ -1,12 +1,42 @@
 #include "viewport.h"
 #include <QApplication>
 #include <QGraphicsScene>
+#include <QGraphicsPixmapItem>
+#include <QStyleOptionGraphicsItem>
+#include <QPainter>
 #include <QWheelEvent>
 #include <QAction>
 #include <QPixmap>
+#include <QSpinBox>
 
 #include "mainwindow.h"
 
+namespace {
+
+// draws the part of the seed overlay exposed by the view
+class SeedLayer : public QGraphicsItem {
+public:
+  explicit SeedLayer(const QImage* image):
+    image_(image)
+  {
+    setFlag(ItemUsesExtendedStyleOption);
+  }
+
+  QRectF boundingRect() const override {
+    return QRectF(image_->rect());
+  }
+
+  void paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget*) override {
+    QRect rect = option->exposedRect.toAlignedRect() & image_->rect();
+    painter->drawImage(rect.topLeft(), *image_, rect);
+  }
+
+private:
+  const QImage* image_;
+};
+
+}
+
 /* Viewport */
 Viewport::Viewport(QWidget* parent) :
   QGraphicsView(parent),
@@ -23,10 +53,21 @@ void Viewport::setScene(const QPixmap& p) {
   pixmap = p;
 
   setScene(new QGraphicsScene());
-  scene()->addPixmap(pixmap);
+  item_ = scene()->addPixmap(pixmap);
+
+  // seeds are kept across the scenes until clearSeeds
+  if (overlay_.size() != pixmap.size()) {
+    overlay_ = QImage(pixmap.size(), QImage::Format_ARGB32_Premultiplied);
+    overlay_.fill(Qt::transparent);
+  }
+  layer_ = new SeedLayer(&overlay_);
+  scene()->addItem(layer_);
+  redrawNotes();
 }
 
 void Viewport::setScene(QGraphicsScene* s) {
+  item_ = nullptr;
+  layer_ = nullptr;
   if (scene()) {
     delete scene();
   }
@@ -34,27 +75,23 @@ void Viewport::setScene(QGraphicsScene* s) {
   QGraphicsView::setScene(s);
 }
 
-void Viewport::redrawNotes() {
-  auto parent = qobject_cast<MainWindow*>(this->parent());
-  if (!parent->show_labels_action->isChecked()) return;
-
-  QSize size(6, 6);
-
-  for (auto& e : source) {
-    QRect aabb(QPoint(e % parent->image.width() - 3, e / parent->image.width() - 3), size);
-
-    QColor color(255, 0, 0, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
+void Viewport::updatePixmap(const QImage& image, const QRect& rect) {
+  if (!item_ || pixmap.size() != image.size()) {
+    setScene(image);
+    return;
   }
+  if (rect.isEmpty()) return;
 
-  for (auto &e : sink) {
-    QRect aabb(QPoint(e % parent->image.width() - 3, e / parent->image.width() - 3), size);
+  QPainter painter(&pixmap);
+  painter.setCompositionMode(QPainter::CompositionMode_Source);
+  painter.drawImage(rect.topLeft(), image, rect);
+  painter.end();
+  item_->setPixmap(pixmap);
+}
 
-    QColor color(0, 0, 255, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
-  }
+void Viewport::redrawNotes() {
+  auto parent = qobject_cast<MainWindow*>(this->parent());
+  if (layer_) layer_->setVisible(parent->show_labels_action->isChecked());
 }
 
 void Viewport::wheelEvent(QWheelEvent *event) {
@@ -65,48 +102,119 @@ void Viewport::wheelEvent(QWheelEvent *event) {
   else QGraphicsView::wheelEvent(event);
 }
 
+void Viewport::clearSeeds() {
+  current_source.clear();
+  current_sink.clear();
+  source.clear();
+  sink.clear();
+  source_map_ = Matrix<bool>();
+  sink_map_ = Matrix<bool>();
+  stroke_ = false;
+
+  overlay_.fill(Qt::transparent);
+  if (layer_) layer_->update();
+}
+
+// adds the pixels of a disc around (x, y) that weren't seeded yet
+void Viewport::stamp(int x, int y, int radius, Matrix<bool>& map, QVector<int>& seeds) {
+  auto parent = qobject_cast<MainWindow*>(this->parent());
+  const int w = parent->image.width(), h = parent->image.height();
+  if (map.size() != parent->image.size()) map = Matrix<bool>(parent->image.size(), false);
+
+  for (int dy = -radius; dy <= radius; ++dy) {
+    int py = y + dy;
+    if (py < 0 || py >= h) continue;
+    for (int dx = -radius; dx <= radius; ++dx) {
+      int px = x + dx;
+      if (px < 0 || px >= w || dx*dx + dy*dy > radius*radius || map(px, py)) continue;
+      map(px, py) = true;
+      seeds << px + py*w;
+    }
+  }
+}
+
+// Seeds the pixels on the segment between two mouse positions, so that fast
+// drags leave no gaps, and draws the segment with the brush width.
+void Viewport::stroke(const QPoint& from, const QPoint& to, Qt::MouseButtons buttons) {
+  auto parent = qobject_cast<MainWindow*>(this->parent());
+  const int radius = parent->brush_box->value();
+
+  bool object = buttons & Qt::MouseButton::LeftButton;
+  if (!object && !(buttons & Qt::MouseButton::RightButton)) return;
+  auto& map = object ? source_map_ : sink_map_;
+  auto& seeds = object ? current_source : current_sink;
+
+  // Bresenham
+  int x = from.x(), y = from.y();
+  int dx = qAbs(to.x() - x), dy = -qAbs(to.y() - y);
+  int sx = x < to.x() ? 1 : -1, sy = y < to.y() ? 1 : -1;
+  int error = dx + dy;
+  while (true) {
+    stamp(x, y, radius, map, seeds);
+    if (x == to.x() && y == to.y()) break;
+    int e2 = 2*error;
+    if (e2 >= dy) {
+      error += dy;
+      x += sx;
+    }
+    if (e2 <= dx) {
+      error += dx;
+      y += sy;
+    }
+  }
+
+  // only the bounds of the segment are repainted
+  QColor color = object ? QColor(255, 0, 0, 255) : QColor(0, 0, 255, 255);
+  int width = qMax(6, 2*radius + 1);
+  QPainter painter(&overlay_);
+  painter.setRenderHint(QPainter::Antialiasing);
+  if (from == to) {
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(color);
+    painter.drawEllipse(QPointF(to), width / 2.0, width / 2.0);
+  }
+  else {
+    painter.setPen(QPen(color, width, Qt::SolidLine, Qt::RoundCap));
+    painter.drawLine(from, to);
+  }
+  painter.end();
+
+  if (layer_) layer_->update(QRectF(from, to).normalized().adjusted(-width, -width, width, width));
+}
+
 void Viewport::mousePressEvent(QMouseEvent* ev) {
   QGraphicsView::mousePressEvent(ev);
   auto pos = mapToScene(ev->pos()).toPoint();
   auto parent = qobject_cast<MainWindow*>(this->parent());
+  stroke_ = false;
   if (pos.x() < 0 || pos.x() >= parent->image.width()) return;
   if (pos.y() < 0 || pos.y() >= parent->image.height()) return;
   if (!scene() || !scene()->sceneRect().contains(pos)) return;
 
-  QRect aabb(QRect(pos - QPoint(3, 3), QSize(6, 6)));
-  if (ev->buttons() & Qt::MouseButton::LeftButton) {
-    QColor color(255, 0, 0, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
-    current_source.push_back(pos.x() + pos.y()*parent->image.width());
-  }
-  else if (ev->buttons() & Qt::MouseButton::RightButton) {
-    QColor color(0, 0, 255, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
-    current_sink.push_back(pos.x() + pos.y()*parent->image.width());
-  }
+  stroke(pos, pos, ev->buttons());
+  last_ = pos;
+  stroke_ = true;
 }
 
 void Viewport::mouseMoveEvent(QMouseEvent* ev) {
   QGraphicsView::mouseMoveEvent(ev);
   auto pos = mapToScene(ev->pos()).toPoint();
   auto parent = qobject_cast<MainWindow*>(this->parent());
-  if (pos.x() < 0 || pos.x() >= parent->image.width()) return;
-  if (pos.y() < 0 || pos.y() >= parent->image.height()) return;
-  if (!scene() || !scene()->sceneRect().contains(pos)) return;
-
-  QRect aabb(QRect(pos - QPoint(3, 3), QSize(6, 6)));
-  if (ev->buttons() & Qt::MouseButton::LeftButton) {
-    QColor color(255, 0, 0, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
-    current_source.push_back(pos.x() + pos.y()*parent->image.width());
-  }
-  else if (ev->buttons() & Qt::MouseButton::RightButton) {
-    QColor color(0, 0, 255, 255);
-    auto brush = QBrush(color, Qt::BrushStyle::SolidPattern);
-    scene()->addEllipse(aabb, QPen(color), brush);
-    current_sink.push_back(pos.x() + pos.y()*parent->image.width());
+  if (pos.x() < 0 || pos.x() >= parent->image.width() ||
+      pos.y() < 0 || pos.y() >= parent->image.height() ||
+      !scene() || !scene()->sceneRect().contains(pos)) {
+    // the stroke starts again where the cursor comes back
+    stroke_ = false;
+    return;
   }
+
+  if (pos == last_ && stroke_) return;
+  stroke(stroke_ ? last_ : pos, pos, ev->buttons());
+  last_ = pos;
+  stroke_ = true;
+}
+
+void Viewport::mouseReleaseEvent(QMouseEvent* ev) {
+  QGraphicsView::mouseReleaseEvent(ev);
+  stroke_ = false;
 }
@@ -4,8 +4,13 @@
 #include <QGraphicsView>
 #include <QPixmap>
 #include <QVector>
+#include <QPoint>
+
+#include "matrix.h"
 
 class QWheelEvent;
+class QGraphicsPixmapItem;
+class QGraphicsItem;
 
 class Viewport : public QGraphicsView {
   Q_OBJECT
@@ -22,12 +27,36 @@ public:
   void setScene(const QPixmap& pixmap);
   void setScene(QGraphicsScene* scene);
 
+  // redraws 'rect' of the shown pixmap from 'image', the seeds on the scene stay
+  void updatePixmap(const QImage& image, const QRect& rect);
+
+  // shows or hides the seeds as the "Show Labels" action says
   void redrawNotes();
 
+  // forgets all of the seeds
+  void clearSeeds();
+
+private:
+  QGraphicsPixmapItem* item_ = nullptr;
+
+  // all seeds are painted into one transparent image over the pixmap, so the
+  // scene holds two items however many seeds there are
+  QImage overlay_;
+  QGraphicsItem* layer_ = nullptr;
+
+  // pixels already seeded since the last clearSeeds, every pixel is added once
+  Matrix<bool> source_map_, sink_map_;
+  QPoint last_;
+  bool stroke_ = false;
+
+  void stroke(const QPoint& from, const QPoint& to, Qt::MouseButtons buttons);
+  void stamp(int x, int y, int radius, Matrix<bool>& map, QVector<int>& seeds);
+
 protected:
   void wheelEvent(QWheelEvent *event) override;
   void mousePressEvent(QMouseEvent* ev) override;
   void mouseMoveEvent(QMouseEvent* ev) override;
+  void mouseReleaseEvent(QMouseEvent* ev) override;
 };
 
 #endif // VIEWPORT_H_INCLUDED__
@@ -0,0 +1,277 @@
+#include "worker.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QSet>
+#include <cstring>
+
+#include "mainwindow.h"
+#include "pyramid.h"
+#include "trace.h"
+
+/* SegmentationWorker */
+SegmentationWorker::SegmentationWorker(QObject* parent):
+  QObject(parent),
+  latest_(0)
+{
+
+}
+
+void SegmentationWorker::supersede(int id) {
+  latest_.store(id);
+}
+
+bool SegmentationWorker::isCancelled(int id) const {
+  return id < latest_.load();
+}
+
+namespace {
+
+// the same colours as QColor arithmetic on doubles truncated to int
+inline uchar dimmed(uchar c) {
+  return uchar((c + 255) >> 1);
+}
+
+inline void border(const uchar* p, uchar* out) {
+  out[0] = p[0] >> 2;
+  out[1] = p[1] >> 2;
+  out[2] = uchar((p[2] + 765) >> 2);
+}
+
+}
+
+QImage SegmentationWorker::render(const QImage& image, const Matrix<bool>& mask, Matrix<uint8_t>& model, Components& marked) {
+  Trace::Scope scope("render");
+  auto canvas = image;
+  composite(image, mask, Matrix<bool>(), canvas);
+  marked = Components();
+  label(mask, model, marked);
+  return canvas;
+}
+
+QRect SegmentationWorker::composite(const QImage& image, const Matrix<bool>& mask, const Matrix<bool>& previous, QImage& canvas) {
+  Q_ASSERT(image.format() == QImage::Format_RGB888 && canvas.format() == QImage::Format_RGB888);
+  Trace::Scope scope("render.composite");
+  const int w = mask.width(), h = mask.height();
+
+  // a pixel depends on its own mask row and the rows above and below
+  QVector<bool> redraw(h, previous.isNull() || previous.size() != mask.size());
+  if (!redraw.isEmpty() && !redraw[0]) {
+    const int bytes = mask.wordsPerLine()*sizeof(Matrix<bool>::word_t);
+    for (int y = 0; y < h; ++y) {
+      if (memcmp(mask.line(y), previous.line(y), bytes)) {
+        for (int j = qMax(0, y - 1); j <= qMin(h - 1, y + 1); ++j) redraw[j] = true;
+      }
+    }
+  }
+
+  int first = h, last = -1;
+  const auto foreground = mask.to<uint8_t>();
+  for (int y = 0; y < h; ++y) {
+    if (!redraw[y]) continue;
+    first = qMin(first, y);
+    last = y;
+
+    const uchar* in = image.constScanLine(y);
+    const uchar* above = image.constScanLine(qMax(0, y - 1));
+    const uchar* below = image.constScanLine(qMin(h - 1, y + 1));
+    const uint8_t* fg = foreground.line(y);
+    uchar* out = canvas.scanLine(y);
+
+    // background is blended with white, no branches so the loop is vectorized
+    for (int x = 0; x < w; ++x) {
+      uchar keep = uchar(-int(fg[x] != 0));
+      for (int c = 0; c < 3; ++c) {
+        out[3*x + c] = (in[3*x + c] & keep) | (dimmed(in[3*x + c]) & ~keep);
+      }
+    }
+
+    // Foreground pixels on the image edge get the border themselves, the
+    // others paint it over their background neighbours. When a pixel has a few
+    // such neighbours, the last one in the row-major order wins.
+    const bool inner_row = y > 0 && y < h - 1;
+    const uint8_t* up = y > 1 ? foreground.line(y - 1) : nullptr;
+    const uint8_t* down = y < h - 2 ? foreground.line(y + 1) : nullptr;
+    for (int x = 0; x < w; ++x) {
+      if (fg[x]) {
+        if (!inner_row || x == 0 || x == w - 1) border(in + 3*x, out + 3*x);
+        continue;
+      }
+
+      const uchar* from = nullptr;
+      if (down && x > 0 && x < w - 1 && down[x]) from = below + 3*x;
+      else if (inner_row && x < w - 2 && fg[x + 1]) from = in + 3*(x + 1);
+      else if (inner_row && x > 1 && fg[x - 1]) from = in + 3*(x - 1);
+      else if (up && x > 0 && x < w - 1 && up[x]) from = above + 3*x;
+      if (from) border(from, out + 3*x);
+    }
+  }
+
+  return last < 0 ? QRect() : QRect(0, first, w, last - first + 1);
+}
+
+void SegmentationWorker::label(const Matrix<bool>& mask, Matrix<uint8_t>& model, Components& marked) {
+  Trace::Scope scope("render.labels");
+  model = mask.to<uint8_t>();
+  marked.update(mask);
+}
+
+int SegmentationWorker::intention(const Matrix<uint8_t>& model, const Components& marked,
+                                  const QVector<int>& source, const QVector<int>& sink, Matrix<uint8_t>& user_intention) {
+  Trace::Scope scope("worker.intention");
+  bool all_foreground = true;
+  bool all_background = true;
+
+  QSet<int> markers;
+  for (auto vert : source + sink) {
+    int mark = marked.label(vert % model.width(), vert / model.width());
+    if (marked.component(mark).foreground) all_background = false;
+    else all_foreground = false;
+    markers.insert(mark);
+  }
+
+  if (all_foreground) {
+    user_intention = model;
+    user_intention.transform([](uint8_t val) {
+      return uint8_t(val != MainWindow::PixelClass::Background);
+    });
+
+    return MainWindow::UserAction::FB;
+  }
+  else if (all_background) {
+    user_intention = model;
+    user_intention.transform([](uint8_t val) {
+      return uint8_t(val != MainWindow::PixelClass::Foreground);
+    });
+
+    return MainWindow::UserAction::BF;
+  }
+  else {
+    // only the regions with seeds are looked at, inside of their bounds
+    user_intention = Matrix<uint8_t>(model.size(), 0);
+    for (auto mark : markers) {
+      QRect bounds = marked.component(mark).bounds;
+      for (int y = bounds.top(); y <= bounds.bottom(); ++y) {
+        const int* label = marked.labels().line(y);
+        uint8_t* allowed = user_intention.line(y);
+        for (int x = bounds.left(); x <= bounds.right(); ++x) {
+          if (label[x] == mark) allowed[x] = 1;
+        }
+      }
+    }
+
+    return MainWindow::UserAction::FBF_OR_BFB;
+  }
+
+  return 0;
+}
+
+void SegmentationWorker::run(const SegmentationWorker::Job& job) {
+  Trace::Scope scope("worker.run");
+  Result result;
+  result.id = job.id;
+  result.cancelled = true;
+  if (isCancelled(job.id)) {
+    emit finished(result);
+    return;
+  }
+
+  if (job.image.cacheKey() != image_key_) {
+    image_key_ = job.image.cacheKey();
+    superpixels_ = Superpixels();
+    nlinks_ = NLinks();
+    graph_ = Graph();
+  }
+
+  if (job.initial) {
+    graph_ = Graph();
+    result.user_intention = Matrix<uint8_t>(job.image.size(), 1);
+    result.marked = Components();
+    result.mask = Matrix<bool>(job.image.size(), true);
+  }
+  else {
+    intention(job.model, job.marked, job.current_source, job.current_sink, result.user_intention);
+    result.mask = job.mask;
+  }
+
+  QElapsedTimer timer, report;
+  timer.start();
+  report.start();
+  if (job.mode != Mode::Graph) {
+    Matrix<uint8_t> labels;
+    if (job.mode == Mode::Superpixels) {
+      if (nlinks_.isNull()) {
+        nlinks_ = NLinks(job.image);
+      }
+      if (superpixels_.isNull()) {
+        superpixels_ = Superpixels(job.image, 16, 10.0f, 5, QThread::idealThreadCount(), nlinks_);
+      }
+      labels = superpixels_.segment(job.image, result.user_intention, job.source, job.sink,
+                                    Graph::Engine::BoykovKolmogorov, job.band, nlinks_);
+    }
+    else {
+      // the weights of the whole image aren't computed for the band alone, only reused
+      labels = Pyramid(job.band).segment(job.image, result.user_intention, job.source, job.sink, nlinks_);
+    }
+    qDebug() << "elapsed:" << timer.elapsed();
+
+    for (int y = 0; y < labels.height(); ++y) {
+      for (int x = 0; x < labels.width(); ++x) {
+        if (labels(x, y) != Pyramid::Unlabelled) result.mask(x, y) = labels(x, y);
+      }
+    }
+  }
+  else {
+    if (nlinks_.isNull()) {
+      nlinks_ = NLinks(job.image);
+    }
+
+    // A small region gets a graph of its own over its bounding box, the
+    // graph of the whole image keeps its flow for the larger ones.
+    QRect region = Graph::regionOf(result.user_intention);
+    bool local = 4*qint64(region.width())*region.height() < qint64(job.image.width())*job.image.height();
+    Graph region_graph;
+    if (local) {
+      region_graph = Graph::fromWeights(nlinks_, result.user_intention);
+    }
+    else {
+      if (graph_.isNull()) {
+        graph_ = Graph::fromWeights(nlinks_, Matrix<uint8_t>());
+      }
+      graph_.setMask(result.user_intention.to<bool>());
+    }
+    Graph& graph = local ? region_graph : graph_;
+
+    // reported at most ten times a second
+    graph.setProgress([&](int augmentations, double flow) {
+      if (report.elapsed() >= 100) {
+        report.restart();
+        emit progress(job.id, augmentations, flow);
+      }
+      return !isCancelled(job.id);
+    });
+    auto cut = graph.minCut(job.source, job.sink, Graph::Engine::BoykovKolmogorov);
+    graph.setProgress(Graph::progress_t());
+    qDebug() << "elapsed:" << timer.elapsed();
+
+    if (graph.isInterrupted()) {
+      emit finished(result);
+      return;
+    }
+
+    graph.fillMask(cut, result.mask);
+  }
+
+  if (isCancelled(job.id)) {
+    emit finished(result);
+    return;
+  }
+
+  // the shown canvas is kept where the mask stayed the same
+  bool redraw = job.initial || job.canvas.size() != job.image.size();
+  result.canvas = redraw ? job.image : job.canvas;
+  result.dirty = composite(job.image, result.mask, redraw ? Matrix<bool>() : job.mask, result.canvas);
+  if (!job.initial) result.marked = job.marked;
+  label(result.mask, result.model, result.marked);
+  result.cancelled = false;
+  emit finished(result);
+}
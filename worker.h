@@ -0,0 +1,99 @@
+#ifndef WORKER_H_INCLUDED__
+#define WORKER_H_INCLUDED__
+
+#include <QObject>
+#include <QImage>
+#include <QRect>
+#include <QMetaType>
+#include <QVector>
+#include <atomic>
+#include <stdint.h>
+
+#include "graph.h"
+#include "matrix.h"
+#include "components.h"
+#include "superpixels.h"
+
+// Runs the segmentation of MainWindow on its own thread: intention -> cut ->
+// mask -> rendering. Runs are numbered, a run older than the last one passed
+// to supersede() stops at the next progress check and its result is dropped.
+// The worker keeps the graph between runs, so that the flow can be reused.
+class SegmentationWorker : public QObject {
+  Q_OBJECT
+
+public:
+  enum class Mode {
+    Graph,
+    Pyramid,
+    Superpixels
+  };
+
+  // everything a run reads, copied from the window
+  struct Job {
+    int id = 0;
+    Mode mode = Mode::Graph;
+    int band = 4;
+    bool initial = true; // first run after loading or clearing
+    QImage image;
+    QImage canvas; // 'mask' rendered over 'image', redrawn only where the mask changes
+    Matrix<bool> mask;
+    Matrix<uint8_t> model;
+    Components marked;
+    QVector<int> source, sink;                 // all of the seeds
+    QVector<int> current_source, current_sink; // seeds since the last shown result
+  };
+
+  struct Result {
+    int id = 0;
+    bool cancelled = false;
+    QImage canvas;
+    QRect dirty; // rows of the canvas that differ from the one of the job
+    Matrix<bool> mask;
+    Matrix<uint8_t> model;
+    Components marked;
+    Matrix<uint8_t> user_intention;
+  };
+
+  explicit SegmentationWorker(QObject* parent = nullptr);
+
+  // thread safe, runs with smaller ids are cancelled
+  void supersede(int id);
+
+  // renders 'mask' over 'image' and labels the regions of the mask into 'marked'
+  static QImage render(const QImage& image, const Matrix<bool>& mask, Matrix<uint8_t>& model, Components& marked);
+
+  // Dims the background of 'image' and frames the foreground with a blue border,
+  // one row at a time. Only the rows next to the pixels where 'mask' differs from
+  // 'previous' are written to 'canvas', all of them if 'previous' is null.
+  // Returns the rows written.
+  static QRect composite(const QImage& image, const Matrix<bool>& mask, const Matrix<bool>& previous, QImage& canvas);
+
+  // 'model' is the mask as bytes, 'marked' has the regions of the mask and is
+  // only updated around the changes if it holds the regions of an older mask
+  static void label(const Matrix<bool>& mask, Matrix<uint8_t>& model, Components& marked);
+
+  // pixels of the regions the new seeds are allowed to change, returns MainWindow::UserAction
+  static int intention(const Matrix<uint8_t>& model, const Components& marked,
+                       const QVector<int>& source, const QVector<int>& sink, Matrix<uint8_t>& user_intention);
+
+public slots:
+  void run(const SegmentationWorker::Job& job);
+
+signals:
+  void progress(int id, int augmentations, double flow);
+  void finished(const SegmentationWorker::Result& result);
+
+private:
+  std::atomic<int> latest_;
+  Graph graph_;
+  NLinks nlinks_; // of the image, the graph is rebuilt from them after a clear
+  Superpixels superpixels_; // regions don't depend on the seeds
+  qint64 image_key_ = 0;
+
+  bool isCancelled(int id) const;
+};
+
+Q_DECLARE_METATYPE(SegmentationWorker::Job)
+Q_DECLARE_METATYPE(SegmentationWorker::Result)
+
+#endif // WORKER_H_INCLUDED__